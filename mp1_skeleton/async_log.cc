@@ -0,0 +1,167 @@
+#include "async_log.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace async_log {
+
+// Per-thread capacity; must be a power of two
+#define RING_SIZE 1024
+// How often the drain thread empties the rings
+#define DRAIN_INTERVAL_MS 20
+
+namespace {
+
+struct Entry {
+  const char* file;
+  int line;
+  google::LogSeverity severity;
+  std::string msg;
+};
+
+// Single-producer (the owning thread), single-consumer (the drain thread)
+// ring. head is only written by the consumer and tail only by the producer.
+struct Ring {
+  Entry entries[RING_SIZE];
+  std::atomic<uint64_t> head{0};
+  std::atomic<uint64_t> tail{0};
+  std::atomic<uint64_t> dropped{0};
+  // Set when the owning thread exits; the drain thread frees the ring once empty
+  std::atomic<bool> abandoned{false};
+};
+
+std::mutex rings_mutex;  // guards rings
+std::vector<std::shared_ptr<Ring>> rings;
+
+std::mutex drain_mutex;
+std::condition_variable drain_cv;
+bool running = false;
+std::thread drain_thread;
+
+std::atomic<uint64_t> total_dropped{0};
+
+// Registers the calling thread's ring on first use and abandons it at thread exit
+struct RingHandle {
+  std::shared_ptr<Ring> ring;
+  RingHandle() : ring(std::make_shared<Ring>()) {
+    std::lock_guard<std::mutex> lock(rings_mutex);
+    rings.push_back(ring);
+  }
+  ~RingHandle() { ring->abandoned.store(true, std::memory_order_release); }
+};
+
+Ring& local_ring() {
+  thread_local RingHandle handle;
+  return *handle.ring;
+}
+
+// Write everything buffered to glog, then flush once. Only one thread drains
+// at a time (the drain thread, or stop() after it has exited).
+void drain() {
+  std::vector<std::shared_ptr<Ring>> snapshot;
+  {
+    std::lock_guard<std::mutex> lock(rings_mutex);
+    snapshot = rings;
+  }
+
+  bool wrote = false;
+  uint64_t dropped_now = 0;
+  for (const std::shared_ptr<Ring>& ring : snapshot) {
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    uint64_t tail = ring->tail.load(std::memory_order_acquire);
+    for (; head != tail; head++) {
+      Entry& e = ring->entries[head & (RING_SIZE - 1)];
+      google::LogMessage(e.file, e.line, e.severity).stream() << e.msg;
+      std::string().swap(e.msg);
+      wrote = true;
+    }
+    ring->head.store(head, std::memory_order_release);
+    dropped_now += ring->dropped.exchange(0, std::memory_order_relaxed);
+  }
+
+  if (dropped_now > 0) {
+    google::LogMessage(__FILE__, __LINE__, google::WARNING).stream()
+        << "Log overloaded: dropped " << dropped_now << " messages";
+    wrote = true;
+  }
+  if (wrote) {
+    google::FlushLogFiles(google::INFO);
+  }
+
+  // forget rings whose thread has exited and that are now empty
+  std::lock_guard<std::mutex> lock(rings_mutex);
+  for (auto it = rings.begin(); it != rings.end();) {
+    Ring& ring = **it;
+    if (ring.abandoned.load(std::memory_order_acquire)
+        && ring.head.load(std::memory_order_relaxed) == ring.tail.load(std::memory_order_acquire)) {
+      it = rings.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void drain_loop() {
+  std::unique_lock<std::mutex> lock(drain_mutex);
+  while (running) {
+    drain_cv.wait_for(lock, std::chrono::milliseconds(DRAIN_INTERVAL_MS));
+    lock.unlock();
+    drain();
+    lock.lock();
+  }
+}
+
+}
+
+void start() {
+  std::lock_guard<std::mutex> lock(drain_mutex);
+  if (running) {
+    return;
+  }
+  running = true;
+  drain_thread = std::thread(drain_loop);
+}
+
+void stop() {
+  {
+    std::lock_guard<std::mutex> lock(drain_mutex);
+    if (!running) {
+      return;
+    }
+    running = false;
+  }
+  drain_cv.notify_one();
+  drain_thread.join();
+  drain();
+}
+
+void push(const char* file, int line, google::LogSeverity severity, std::string msg) {
+  if (severity >= google::FATAL) {
+    google::LogMessage(file, line, severity).stream() << msg; // aborts
+    return;
+  }
+  Ring& ring = local_ring();
+  uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+  if (tail - ring.head.load(std::memory_order_acquire) == RING_SIZE) {
+    ring.dropped.fetch_add(1, std::memory_order_relaxed);
+    total_dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  Entry& e = ring.entries[tail & (RING_SIZE - 1)];
+  e.file = file;
+  e.line = line;
+  e.severity = severity;
+  e.msg = std::move(msg);
+  ring.tail.store(tail + 1, std::memory_order_release);
+}
+
+uint64_t dropped() {
+  return total_dropped.load(std::memory_order_relaxed);
+}
+
+}
@@ -0,0 +1,37 @@
+#ifndef ASYNC_LOG_H
+#define ASYNC_LOG_H
+
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <glog/logging.h>
+
+/*
+ * Asynchronous backend for glog. A request thread only formats its message
+ * and pushes it into a lock-free ring buffer owned by that thread; a single
+ * background thread drains every ring, writes the messages to glog in
+ * batches and flushes the log files once per batch instead of once per line.
+ *
+ * Loss is bounded and counted: when a thread's ring is full, new messages
+ * from that thread are dropped, and the drain thread logs how many were
+ * lost. FATAL messages bypass the rings so they are never dropped.
+ */
+namespace async_log {
+
+// Start the drain thread. Messages pushed before this are kept until then.
+void start();
+
+// Drain what is buffered, flush the log files and stop the drain thread
+void stop();
+
+// Queue one message; never blocks
+void push(const char* file, int line, google::LogSeverity severity, std::string msg);
+
+// Messages dropped so far because a ring was full
+uint64_t dropped();
+
+}
+
+#define log(severity, msg) do { std::ostringstream log_ss; log_ss << msg; async_log::push(__FILE__, __LINE__, google::severity, log_ss.str()); } while (0)
+
+#endif
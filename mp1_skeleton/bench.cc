@@ -0,0 +1,256 @@
+/*
+ * Microbenchmarks for the server's building blocks.
+ *
+ * Build with `make bench` and run `./bench [filter]`; only benchmarks whose
+ * name contains `filter` are run. Results are printed one per line.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "latency_stats.h"
+#include "post_format.h"
+#include "post_index.h"
+#include "slab_pool.h"
+#include "sns.pb.h"
+
+using csce662::Message;
+
+typedef std::chrono::steady_clock bench_clock;
+
+// Every heap allocation in the process goes through here, so a benchmark can
+// report allocations per operation. The whole set of new and delete is
+// replaced, all through the same two functions, so every delete matches
+// its new. They are kept out of line: once malloc or free is inlined into
+// a std::allocator, GCC sees it paired with operator new or delete and
+// warns of a mismatch.
+static std::atomic<uint64_t> allocations(0);
+
+__attribute__((noinline)) static void* counted_alloc(std::size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size == 0 ? 1 : size)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) static void counted_free(void* p) { std::free(p); }
+
+void* operator new(std::size_t size) { return counted_alloc(size); }
+void* operator new[](std::size_t size) { return counted_alloc(size); }
+void operator delete(void* p) noexcept { counted_free(p); }
+void operator delete[](void* p) noexcept { counted_free(p); }
+void operator delete(void* p, std::size_t) noexcept { counted_free(p); }
+void operator delete[](void* p, std::size_t) noexcept { counted_free(p); }
+
+// Run op `iterations` times and print heap allocations and time per iteration
+static void reportAllocs(const std::string& name, int iterations, const std::function<void()>& op)
+{
+    uint64_t before = allocations.load();
+    auto start = bench_clock::now();
+    for (int i = 0; i < iterations; i++) {
+        op();
+    }
+    double ns = std::chrono::duration<double, std::nano>(bench_clock::now() - start).count();
+    std::cout << name << ": " << static_cast<double>(allocations.load() - before) / iterations
+              << " allocs/op, " << ns / iterations << "ns/op" << std::endl;
+}
+
+// Print the p50/p99/p999 of a set of per-operation latencies (in ns)
+static void reportLatency(const std::string& name, std::vector<double>& samples)
+{
+    std::sort(samples.begin(), samples.end());
+    auto pct = [&samples](double p) {
+        return samples[std::min(samples.size() - 1, static_cast<std::size_t>(p * samples.size()))];
+    };
+    std::cout << name << ": n=" << samples.size()
+              << " p50=" << pct(0.50) << "ns p99=" << pct(0.99)
+              << "ns p999=" << pct(0.999) << "ns" << std::endl;
+}
+
+// Random post text drawn from a Zipf-like vocabulary, so a few terms are very
+// common and most are rare, like real posts
+class PostGenerator
+{
+public:
+  explicit PostGenerator(int vocabulary, unsigned seed = 662) : rng(seed)
+  {
+      std::vector<double> weights;
+      for (int i = 1; i <= vocabulary; i++) {
+          weights.push_back(1.0 / i);
+      }
+      dist = std::discrete_distribution<int>(weights.begin(), weights.end());
+  }
+
+  std::string term() { return "w" + std::to_string(dist(rng)); }
+
+  std::string post(int words = 12)
+  {
+      std::string text;
+      for (int i = 0; i < words; i++) {
+          text += term() + " ";
+      }
+      return text;
+  }
+
+private:
+  std::mt19937 rng;
+  std::discrete_distribution<int> dist;
+};
+
+static void benchPostIndex()
+{
+    const int kPosts = 200000;
+    PostGenerator gen(50000);
+    std::vector<std::string> posts;
+    std::size_t text_bytes = 0;
+    for (int i = 0; i < kPosts; i++) {
+        posts.push_back(gen.post());
+        text_bytes += posts.back().size();
+    }
+
+    PostIndex index;
+    auto start = bench_clock::now();
+    for (int i = 0; i < kPosts; i++) {
+        index.add(i, posts[i]);
+    }
+    double add_ns = std::chrono::duration<double, std::nano>(bench_clock::now() - start).count();
+    std::cout << "PostIndex/add: " << add_ns / kPosts << "ns/post" << std::endl;
+    std::cout << "PostIndex/memory: " << index.termCount() << " terms, "
+              << static_cast<double>(index.memoryUsage()) / kPosts << " bytes/post ("
+              << static_cast<double>(text_bytes) / kPosts << " bytes/post of text)" << std::endl;
+
+    // one common + one rare term, and two common terms
+    std::vector<std::pair<std::string, std::vector<std::string>>> queries = {
+        {"PostIndex/search_common_rare", {"w1", "w500"}},
+        {"PostIndex/search_common_common", {"w1", "w2"}},
+        {"PostIndex/search_three_terms", {"w1", "w3", "w40"}},
+    };
+    for (auto& query : queries) {
+        std::vector<double> samples;
+        std::size_t hits = 0;
+        for (int i = 0; i < 2000; i++) {
+            auto t0 = bench_clock::now();
+            hits = index.search(query.second).size();
+            samples.push_back(std::chrono::duration<double, std::nano>(bench_clock::now() - t0).count());
+        }
+        reportLatency(query.first + " (" + std::to_string(hits) + " hits)", samples);
+    }
+}
+
+// Per-user record allocation: one heap allocation per record, as Login used
+// to do, against SlabPool with freelist reuse
+static void benchSlabPool()
+{
+    struct Record {
+        std::string username;
+        std::vector<Record*> followers;
+        std::vector<Record*> following;
+        uint64_t seq = 0;
+    };
+    const int kRecords = 100000;
+
+    std::vector<Record*> heap_records;
+    reportAllocs("SlabPool/create_heap", kRecords, [&]() { heap_records.push_back(new Record); });
+    for (Record* r : heap_records) {
+        delete r;
+    }
+
+    SlabPool<Record> pool;
+    std::vector<SlabPool<Record>::Handle> handles;
+    handles.reserve(kRecords);
+    reportAllocs("SlabPool/create_pool", kRecords, [&]() { handles.push_back(pool.create()); });
+    std::cout << "SlabPool/memory: " << sizeof(Record) << " byte records, "
+              << static_cast<double>(pool.memoryUsage()) / kRecords << " pool bytes/record" << std::endl;
+    for (SlabPool<Record>::Handle h : handles) {
+        pool.destroy(h);
+    }
+    reportAllocs("SlabPool/create_pool_reuse", kRecords, [&]() { pool.create(); });
+}
+
+// Cost of recording one latency sample, alone and around a timed scope
+static void benchLatencyStats()
+{
+    const int kSamples = 10000000;
+    uint64_t value = 1;
+    reportAllocs("LatencyStats/record", kSamples, [&]() {
+        latency_stats::record(latency_stats::FANOUT, value);
+        value = value * 6364136223846793005ULL + 1442695040888963407ULL;
+        value >>= 40;
+    });
+    reportAllocs("LatencyStats/scoped_timer", kSamples, [&]() {
+        latency_stats::ScopedTimer timer(latency_stats::LOGIN);
+    });
+    auto start = bench_clock::now();
+    latency_stats::Summary summary = latency_stats::summarize(latency_stats::FANOUT);
+    double ns = std::chrono::duration<double, std::nano>(bench_clock::now() - start).count();
+    std::cout << "LatencyStats/summarize: " << ns << "ns (" << summary.count << " samples)" << std::endl;
+}
+
+// The .txt helpers run on every post and every history line
+static void benchPostFormat()
+{
+    const int kIterations = 100000;
+    PostGenerator gen(5000);
+    const std::string user = "user42";
+    const std::string text = gen.post(10);
+    google::protobuf::Timestamp now;
+    now.set_seconds(time(NULL));
+    const std::string time_str = timestamp_to_string(now);
+    const std::string line = format_file_output(user, text, time_str);
+
+    reportAllocs("PostFormat/timestamp_to_string", kIterations, [&]() { timestamp_to_string(now); });
+    reportAllocs("PostFormat/format_file_output", kIterations, [&]() { format_file_output(user, text, time_str); });
+    reportAllocs("PostFormat/parse_data", kIterations, [&]() { parse_data(line); });
+    reportAllocs("PostFormat/convert_to_timestamp", kIterations, [&]() { convert_to_timestamp(time_str); });
+    Message message;
+    reportAllocs("PostFormat/parse_post", kIterations, [&]() { parse_post(line, &message); });
+
+    // Timeline entry: latest 20 posts out of a following file of n posts
+    for (int posts : {100, 10000, 100000}) {
+        std::string path = "bench_following.txt";
+        {
+            std::ofstream out(path);
+            for (int i = 0; i < posts; i++) {
+                out << format_file_output("user" + std::to_string(i % 100), gen.post(10), time_str) << std::endl;
+            }
+        }
+        reportAllocs("PostFormat/history_load (" + std::to_string(posts) + " posts)", 200, [&]() {
+            for (const auto& data_line : read_last_lines(path, 20, posts)) {
+                Message response;
+                parse_post(data_line.second, &response);
+            }
+        });
+        std::remove(path.c_str());
+    }
+}
+
+int main(int argc, char** argv)
+{
+    std::string filter = argc > 1 ? argv[1] : "";
+    std::vector<std::pair<std::string, std::function<void()>>> benchmarks = {
+        {"PostIndex", benchPostIndex},
+        {"SlabPool", benchSlabPool},
+        {"LatencyStats", benchLatencyStats},
+        {"PostFormat", benchPostFormat},
+    };
+    for (auto& benchmark : benchmarks) {
+        if (benchmark.first.find(filter) != std::string::npos) {
+            benchmark.second();
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,369 @@
+/*
+ * End-to-end benchmarks of the whole service.
+ *
+ * Every workload gets a fresh SNSServiceImpl with its own temporary data
+ * directory, reached over an in-process channel, so a run neither needs a
+ * tsd nor touches the .txt files in the current directory, and network
+ * noise doesn't hide changes in the server itself.
+ *
+ * Build with `make bench_e2e` and run `./bench_e2e [options] [filter]`; only
+ * workloads whose name contains `filter` are run. Each workload prints one
+ * JSON object per line to stdout, so results can be collected and compared
+ * across revisions; progress goes to stderr.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <grpc++/grpc++.h>
+#include <glog/logging.h>
+
+#include "sns.grpc.pb.h"
+#include "sns_client.h"
+#include "sns_service.h"
+#include "async_log.h"
+
+using grpc::Channel;
+using grpc::ClientContext;
+using grpc::Server;
+using grpc::ServerBuilder;
+using grpc::Status;
+using csce662::Message;
+using csce662::Reply;
+using csce662::Request;
+using csce662::SNSService;
+
+namespace fs = std::filesystem;
+
+typedef std::chrono::steady_clock bench_clock;
+
+// Sizes of the workloads, set from the command line
+struct Params {
+  int users = 2000;
+  int follows = 20;
+  int followers = 1000;
+  int posts = 200;
+  int rounds = 5;
+  int threads = 8;
+};
+
+// A fresh service in a temporary directory, torn down with the object
+class Harness
+{
+public:
+  Harness() {
+    std::string dir_template = (fs::temp_directory_path() / "sns-bench-XXXXXX").string();
+    if (mkdtemp(&dir_template[0]) == nullptr) {
+      throw std::runtime_error("mkdtemp failed for " + dir_template);
+    }
+    data_dir = dir_template;
+    service.reset(new SNSServiceImpl(data_dir));
+    ServerBuilder builder;
+    builder.RegisterService(service.get());
+    server = builder.BuildAndStart();
+    stub = SNSService::NewStub(server->InProcessChannel(grpc::ChannelArguments()));
+  }
+
+  ~Harness() {
+    stub.reset();
+    server->Shutdown(std::chrono::system_clock::now() + std::chrono::seconds(1));
+    server->Wait();
+    server.reset();
+    service.reset();
+    std::error_code ec;
+    fs::remove_all(data_dir, ec);
+  }
+
+  Status login(const std::string& username) {
+    Request request;
+    request.set_username(username);
+    Reply reply;
+    ClientContext context;
+    return stub->Login(&context, request, &reply);
+  }
+
+  Status follow(const std::string& username, const std::string& followee) {
+    Request request;
+    request.set_username(username);
+    request.add_arguments(followee);
+    Reply reply;
+    ClientContext context;
+    return stub->Follow(&context, request, &reply);
+  }
+
+  std::string data_dir;
+  std::unique_ptr<SNSServiceImpl> service;
+  std::unique_ptr<Server> server;
+  std::unique_ptr<SNSService::Stub> stub;
+};
+
+std::string username(int i) {
+  return "user" + std::to_string(i);
+}
+
+// Run op(i) for i in [0, count) on `threads` threads and return each op's
+// latency in microseconds, in no particular order
+std::vector<double> runConcurrently(int count, int threads, const std::function<void(int)>& op) {
+  std::vector<std::vector<double>> per_thread(threads);
+  std::atomic<int> next(0);
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threads; t++) {
+    workers.emplace_back([&, t]() {
+      for (int i = next++; i < count; i = next++) {
+        auto start = bench_clock::now();
+        op(i);
+        per_thread[t].push_back(std::chrono::duration<double, std::micro>(bench_clock::now() - start).count());
+      }
+    });
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  std::vector<double> samples;
+  for (auto& thread_samples : per_thread) {
+    samples.insert(samples.end(), thread_samples.begin(), thread_samples.end());
+  }
+  return samples;
+}
+
+// Print one workload's result as a JSON object on its own line. params is
+// a list of already formatted "key":value pairs describing the workload.
+void report(const std::string& workload, const std::string& params, double seconds,
+            std::vector<double>& samples, uint64_t errors) {
+  std::sort(samples.begin(), samples.end());
+  auto pct = [&samples](double p) {
+    return samples.empty() ? 0.0 : samples[std::min(samples.size() - 1, static_cast<std::size_t>(p * samples.size()))];
+  };
+  std::ostringstream out;
+  out << "{\"workload\":\"" << workload << "\"," << params
+      << ",\"ops\":" << samples.size() << ",\"errors\":" << errors
+      << ",\"seconds\":" << seconds << ",\"ops_per_sec\":" << (seconds > 0 ? samples.size() / seconds : 0)
+      << ",\"p50_us\":" << pct(0.50) << ",\"p99_us\":" << pct(0.99) << ",\"p999_us\":" << pct(0.999)
+      << ",\"max_us\":" << (samples.empty() ? 0.0 : samples.back()) << "}";
+  std::cout << out.str() << std::endl;
+}
+
+double secondsSince(bench_clock::time_point start) {
+  return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+// Sender and receivers share a process, so post traces use the steady clock
+int64_t steadyMicros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(bench_clock::now().time_since_epoch()).count();
+}
+
+// Many users logging in at once
+void benchLoginStorm(const Params& params) {
+  Harness harness;
+  std::atomic<uint64_t> errors(0);
+  auto start = bench_clock::now();
+  std::vector<double> samples = runConcurrently(params.users, params.threads, [&](int i) {
+    if (!harness.login(username(i)).ok()) {
+      errors++;
+    }
+  });
+  report("LoginStorm", "\"users\":" + std::to_string(params.users) + ",\"threads\":" + std::to_string(params.threads),
+         secondsSince(start), samples, errors);
+}
+
+// Every user following `follows` random others with single Follow calls
+void benchFollowStorm(const Params& params) {
+  Harness harness;
+  runConcurrently(params.users, params.threads, [&](int i) { harness.login(username(i)); });
+  std::atomic<uint64_t> errors(0);
+  int ops = params.users * params.follows;
+  auto start = bench_clock::now();
+  std::vector<double> samples = runConcurrently(ops, params.threads, [&](int i) {
+    thread_local std::mt19937 rng(std::random_device{}());
+    int follower = i / params.follows;
+    int followee = std::uniform_int_distribution<int>(0, params.users - 2)(rng);
+    if (followee >= follower) {
+      followee++;  // never yourself
+    }
+    Status status = harness.follow(username(follower), username(followee));
+    if (!status.ok() && status.error_code() != grpc::ALREADY_EXISTS) {
+      errors++;
+    }
+  });
+  report("FollowStorm", "\"users\":" + std::to_string(params.users) + ",\"follows\":" + std::to_string(params.follows)
+         + ",\"threads\":" + std::to_string(params.threads), secondsSince(start), samples, errors);
+}
+
+// One author with `followers` followers in timeline mode posting `posts`
+// posts back to back; measures each delivery from post to follower
+void benchPostBurst(const Params& params) {
+  Harness harness;
+  std::string author = username(params.followers);
+  harness.login(author);
+  runConcurrently(params.followers, params.threads, [&](int i) {
+    harness.login(username(i));
+    harness.follow(username(i), author);
+  });
+
+  std::mutex samples_mutex;
+  std::condition_variable all_delivered;
+  std::vector<double> samples;
+  uint64_t expected = static_cast<uint64_t>(params.followers) * params.posts;
+  std::shared_ptr<Channel> channel = harness.server->InProcessChannel(grpc::ChannelArguments());
+  std::vector<std::unique_ptr<SNSClient>> followers;
+  std::vector<std::unique_ptr<TimelineSubscription>> timelines;
+  for (int i = 0; i < params.followers; i++) {
+    followers.emplace_back(new SNSClient(channel, username(i)));
+    timelines.push_back(followers.back()->subscribe([&](const Message& post) {
+      if (!post.has_trace()) {
+        return;
+      }
+      int64_t latency = steadyMicros() - post.trace().client_send_us();
+      std::lock_guard<std::mutex> lock(samples_mutex);
+      samples.push_back(latency);
+      if (samples.size() == expected) {
+        all_delivered.notify_all();
+      }
+    }));
+  }
+  // Timeline entry is not acknowledged, so give the streams a moment to register
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+  ClientContext context;
+  auto stream = harness.stub->Timeline(&context);
+  Message initial_message;
+  initial_message.set_username(author);
+  stream->Write(initial_message);
+  auto start = bench_clock::now();
+  for (int p = 0; p < params.posts; p++) {
+    Message post;
+    post.set_username(author);
+    post.set_msg("burst post " + std::to_string(p));
+    post.mutable_timestamp()->set_seconds(time(NULL));
+    post.mutable_trace()->set_client_send_us(steadyMicros());
+    stream->Write(post);
+  }
+  double seconds;
+  uint64_t errors;
+  {
+    std::unique_lock<std::mutex> lock(samples_mutex);
+    all_delivered.wait_for(lock, std::chrono::seconds(60), [&]() { return samples.size() == expected; });
+    seconds = secondsSince(start);
+    errors = expected - samples.size();  // deliveries that never arrived
+  }
+  stream->WritesDone();
+  stream->Finish();
+  for (auto& timeline : timelines) {
+    timeline->close();
+  }
+  std::lock_guard<std::mutex> lock(samples_mutex);
+  report("PostBurst", "\"followers\":" + std::to_string(params.followers) + ",\"posts\":" + std::to_string(params.posts),
+         seconds, samples, errors);
+}
+
+// Users repeatedly leaving and re-entering their timeline, each entry
+// loading the last 20 posts of a long following file
+void benchReconnectStorm(const Params& params) {
+  Harness harness;
+  int users = std::max(1, params.users / 4);
+  std::string author = username(users);
+  harness.login(author);
+  runConcurrently(users, params.threads, [&](int i) {
+    harness.login(username(i));
+    harness.follow(username(i), author);
+  });
+  {
+    // fill every user's following file
+    ClientContext context;
+    auto stream = harness.stub->Timeline(&context);
+    Message initial_message;
+    initial_message.set_username(author);
+    stream->Write(initial_message);
+    for (int p = 0; p < 100; p++) {
+      Message post;
+      post.set_username(author);
+      post.set_msg("history post " + std::to_string(p));
+      post.mutable_timestamp()->set_seconds(time(NULL));
+      stream->Write(post);
+    }
+    stream->WritesDone();
+    stream->Finish();
+  }
+
+  std::atomic<uint64_t> errors(0);
+  auto start = bench_clock::now();
+  std::vector<double> samples = runConcurrently(users * params.rounds, params.threads, [&](int i) {
+    ClientContext context;
+    auto stream = harness.stub->Timeline(&context);
+    Message message;
+    message.set_username(username(i % users));
+    stream->Write(message);
+    stream->WritesDone();
+    int history = 0;
+    while (stream->Read(&message)) {
+      history++;
+    }
+    if (!stream->Finish().ok() || history != 20) {
+      errors++;
+    }
+  });
+  report("ReconnectStorm", "\"users\":" + std::to_string(users) + ",\"rounds\":" + std::to_string(params.rounds)
+         + ",\"threads\":" + std::to_string(params.threads), secondsSince(start), samples, errors);
+}
+
+void usage() {
+  std::cerr << "Usage: bench_e2e [-n users] [-f follows per user] [-F followers] [-P posts]\n"
+            << "                 [-r reconnect rounds] [-t threads] [filter]\n";
+}
+
+int main(int argc, char** argv)
+{
+  Params params;
+  int opt = 0;
+  while ((opt = getopt(argc, argv, "n:f:F:P:r:t:")) != -1) {
+    switch (opt) {
+    case 'n':
+      params.users = std::max(2, atoi(optarg));break;
+    case 'f':
+      params.follows = std::max(1, atoi(optarg));break;
+    case 'F':
+      params.followers = std::max(1, atoi(optarg));break;
+    case 'P':
+      params.posts = std::max(1, atoi(optarg));break;
+    case 'r':
+      params.rounds = std::max(1, atoi(optarg));break;
+    case 't':
+      params.threads = std::max(1, atoi(optarg));break;
+    default:
+      usage();
+      return 1;
+    }
+  }
+  std::string filter = optind < argc ? argv[optind] : "";
+
+  google::InitGoogleLogging(argv[0]);
+  async_log::start();
+  std::vector<std::pair<std::string, std::function<void(const Params&)>>> benchmarks = {
+    {"LoginStorm", benchLoginStorm},
+    {"FollowStorm", benchFollowStorm},
+    {"PostBurst", benchPostBurst},
+    {"ReconnectStorm", benchReconnectStorm},
+  };
+  for (auto& benchmark : benchmarks) {
+    if (benchmark.first.find(filter) != std::string::npos) {
+      std::cerr << "Running " << benchmark.first << "..." << std::endl;
+      benchmark.second(params);
+    }
+  }
+  async_log::stop();
+  return 0;
+}
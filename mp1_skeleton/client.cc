@@ -28,6 +28,8 @@ void IClient::displayTitle() const
   std::cout << " FOLLOW <username>\n";
   std::cout << " UNFOLLOW <username>\n";
   std::cout << " LIST\n";
+  std::cout << " SEARCH <term> [<term> ...]\n";
+  std::cout << " STATS\n";
   std::cout << " TIMELINE\n";
   std::cout << "=====================================\n";
 }
@@ -50,7 +52,7 @@ std::string IClient::getCommand() const
       input = cmd + " " + argument;
     } else {
       toUpperCase(input);
-      if (input != "LIST" && input != "TIMELINE") {
+      if (input != "LIST" && input != "TIMELINE" && input != "STATS") {
 	std::cout << "Invalid Command\n";
 	continue;
       }
@@ -50,6 +50,7 @@ struct IReply
 
 std::string getPostMessage();
 void displayPostMessage(const std::string& sender, const std::string& message, std::time_t& time);
+void displayReConnectionMessage(const std::string& host, const std::string & port);
   
 class IClient
 {
@@ -0,0 +1,24 @@
+#include "hlc.h"
+
+#include <algorithm>
+#include <chrono>
+
+uint64_t HybridClock::now() {
+  uint64_t wall = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+  uint64_t physical = wall << LOGICAL_BITS;
+  uint64_t prev = last.load(std::memory_order_relaxed);
+  while (true) {
+    // A full counter carries into the physical part, which stays ordered
+    uint64_t next = std::max(physical, prev + 1);
+    if (last.compare_exchange_weak(prev, next, std::memory_order_relaxed)) {
+      return next;
+    }
+  }
+}
+
+void HybridClock::update(uint64_t remote) {
+  uint64_t prev = last.load(std::memory_order_relaxed);
+  while (prev < remote && !last.compare_exchange_weak(prev, remote, std::memory_order_relaxed)) {
+  }
+}
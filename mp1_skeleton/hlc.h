@@ -0,0 +1,36 @@
+#ifndef HLC_H
+#define HLC_H
+
+#include <atomic>
+#include <cstdint>
+
+/*
+ * Hybrid logical clock for stamping posts. A stamp packs the wall-clock
+ * milliseconds in its high 48 bits and a logical counter in its low 16, so
+ * stamps compare as plain integers.
+ *
+ * now() never returns the same stamp twice and never goes backwards, even
+ * when the wall clock does or many posts share a millisecond: the counter
+ * advances instead. update() merges a stamp from another server, so posts
+ * a server makes after seeing one of another shard's posts order after it
+ * on every server, whatever their clocks say.
+ */
+class HybridClock
+{
+public:
+  static const int LOGICAL_BITS = 16;
+
+  // Stamp for a new event, later than every stamp given out or merged
+  uint64_t now();
+
+  // Merge a stamp received from another server
+  void update(uint64_t remote);
+
+  static uint64_t physicalMs(uint64_t stamp) { return stamp >> LOGICAL_BITS; }
+  static uint64_t logical(uint64_t stamp) { return stamp & ((uint64_t(1) << LOGICAL_BITS) - 1); }
+
+private:
+  std::atomic<uint64_t> last{0};
+};
+
+#endif
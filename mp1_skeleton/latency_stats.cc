@@ -0,0 +1,134 @@
+#include "latency_stats.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace latency_stats {
+
+#define SUB_BUCKET_BITS 5
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+// Values are clamped to 2^MAX_EXPONENT ns (~73 minutes)
+#define MAX_EXPONENT 42
+#define BUCKETS (2 * SUB_BUCKETS + (MAX_EXPONENT - SUB_BUCKET_BITS) * SUB_BUCKETS)
+
+namespace {
+
+const char* const names[METRIC_COUNT] = {
+  "Login", "List", "Follow", "UnFollow", "FollowBatch", "Search", "TimelineEntry", "Fanout",
+};
+
+std::size_t bucket_index(uint64_t ns) {
+  ns = std::min<uint64_t>(ns, (uint64_t(1) << MAX_EXPONENT) - 1);
+  if (ns < 2 * SUB_BUCKETS) {
+    return ns;
+  }
+  int exponent = 63 - __builtin_clzll(ns);
+  int shift = exponent - SUB_BUCKET_BITS;
+  return 2 * SUB_BUCKETS + (shift - 1) * SUB_BUCKETS + ((ns >> shift) - SUB_BUCKETS);
+}
+
+// Largest value that falls into bucket index
+uint64_t bucket_max(std::size_t index) {
+  if (index < 2 * SUB_BUCKETS) {
+    return index;
+  }
+  std::size_t shift = (index - 2 * SUB_BUCKETS) / SUB_BUCKETS + 1;
+  uint64_t top = (index - 2 * SUB_BUCKETS) % SUB_BUCKETS + SUB_BUCKETS;
+  return ((top + 1) << shift) - 1;
+}
+
+// One thread's histograms. Only the owning thread writes the counters.
+struct ThreadHistograms {
+  std::atomic<uint64_t> counts[METRIC_COUNT][BUCKETS];
+  std::atomic<uint64_t> max[METRIC_COUNT];
+  ThreadHistograms() {
+    for (int m = 0; m < METRIC_COUNT; m++) {
+      for (int b = 0; b < BUCKETS; b++) {
+        counts[m][b].store(0, std::memory_order_relaxed);
+      }
+      max[m].store(0, std::memory_order_relaxed);
+    }
+  }
+};
+
+std::mutex registry_mutex;
+// Every set ever handed out; never freed, so no sample is lost
+std::vector<std::unique_ptr<ThreadHistograms>> registry;
+// Sets whose thread has exited, handed to the next new thread
+std::vector<ThreadHistograms*> released;
+
+struct LocalHandle {
+  ThreadHistograms* histograms;
+  LocalHandle() {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    if (!released.empty()) {
+      histograms = released.back();
+      released.pop_back();
+    } else {
+      registry.emplace_back(new ThreadHistograms);
+      histograms = registry.back().get();
+    }
+  }
+  ~LocalHandle() {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    released.push_back(histograms);
+  }
+};
+
+ThreadHistograms& local_histograms() {
+  thread_local LocalHandle handle;
+  return *handle.histograms;
+}
+
+}
+
+const char* name(Metric metric) {
+  return names[metric];
+}
+
+void record(Metric metric, uint64_t ns) {
+  ThreadHistograms& h = local_histograms();
+  std::atomic<uint64_t>& count = h.counts[metric][bucket_index(ns)];
+  count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  if (ns > h.max[metric].load(std::memory_order_relaxed)) {
+    h.max[metric].store(ns, std::memory_order_relaxed);
+  }
+}
+
+Summary summarize(Metric metric) {
+  std::vector<uint64_t> merged(BUCKETS, 0);
+  Summary summary;
+  {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    for (const auto& h : registry) {
+      for (int b = 0; b < BUCKETS; b++) {
+        merged[b] += h->counts[metric][b].load(std::memory_order_relaxed);
+      }
+      summary.max = std::max(summary.max, h->max[metric].load(std::memory_order_relaxed));
+    }
+  }
+  for (uint64_t c : merged) {
+    summary.count += c;
+  }
+  if (summary.count == 0) {
+    return summary;
+  }
+
+  // smallest bucket whose cumulative count reaches each quantile
+  const double quantiles[] = {0.50, 0.99, 0.999};
+  uint64_t* results[] = {&summary.p50, &summary.p99, &summary.p999};
+  uint64_t seen = 0;
+  int next = 0;
+  for (int b = 0; b < BUCKETS && next < 3; b++) {
+    seen += merged[b];
+    while (next < 3 && seen >= quantiles[next] * summary.count) {
+      *results[next++] = std::min(bucket_max(b), summary.max);
+    }
+  }
+  return summary;
+}
+
+}
@@ -0,0 +1,66 @@
+#ifndef LATENCY_STATS_H
+#define LATENCY_STATS_H
+
+#include <chrono>
+#include <cstdint>
+
+/*
+ * Always-on latency histograms for the server's RPCs.
+ *
+ * Buckets are HDR-style log-linear: values below 2*SUB_BUCKETS ns get a
+ * bucket each, and every power of two above that is split into SUB_BUCKETS
+ * buckets, so any value is reported within ~3% of its true size.
+ *
+ * Every thread records into its own set of histograms (one writer per
+ * counter, so a record is a relaxed load + store and never contends), and
+ * the per-thread histograms are summed when someone asks for a summary.
+ */
+namespace latency_stats {
+
+enum Metric {
+  LOGIN,
+  LIST,
+  FOLLOW,
+  UNFOLLOW,
+  FOLLOW_BATCH,
+  SEARCH,
+  TIMELINE_ENTRY,  // Timeline stream open until its history has been queued
+  FANOUT,          // one post delivered to all followers
+  METRIC_COUNT
+};
+
+const char* name(Metric metric);
+
+// Record one latency sample, in nanoseconds
+void record(Metric metric, uint64_t ns);
+
+struct Summary {
+  uint64_t count = 0;
+  // in nanoseconds
+  uint64_t p50 = 0;
+  uint64_t p99 = 0;
+  uint64_t p999 = 0;
+  uint64_t max = 0;
+};
+
+// Merge every thread's histogram for metric and compute its percentiles
+Summary summarize(Metric metric);
+
+// Records the time between its construction and destruction
+class ScopedTimer
+{
+public:
+  explicit ScopedTimer(Metric m) : metric(m), start(std::chrono::steady_clock::now()) {}
+  ~ScopedTimer() {
+    record(metric, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::steady_clock::now() - start).count());
+  }
+
+private:
+  Metric metric;
+  std::chrono::steady_clock::time_point start;
+};
+
+}
+
+#endif
@@ -0,0 +1,122 @@
+#include "peer_link.h"
+
+#include <algorithm>
+
+#include "async_log.h"
+
+using csce662::FanoutBatch;
+using csce662::FanoutPost;
+using csce662::Message;
+using csce662::Reply;
+
+// Posts a link holds before it starts dropping them
+#define PEER_QUEUE_LIMIT 100000
+// Most posts written in one batch
+#define PEER_BATCH_POSTS 256
+// Pause before reopening a failed stream
+#define PEER_RETRY_MS 500
+
+PeerLink::PeerLink(csce662::SNSPeer::Stub* s, const std::string& peer_address)
+  : stub(s), address(peer_address), started(std::chrono::steady_clock::now()) {
+  sender = std::thread(&PeerLink::run, this);
+}
+
+PeerLink::~PeerLink() {
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    running = false;
+    if (active_context) {
+      active_context->TryCancel();
+    }
+  }
+  cv.notify_all();
+  sender.join();
+}
+
+void PeerLink::enqueue(const Message& post, std::vector<std::string> followers) {
+  FanoutPost item;
+  *item.mutable_post() = post;
+  item.mutable_post()->clear_seq();  // each follower's shard numbers its own
+  for (std::string& follower : followers) {
+    item.add_followers(std::move(follower));
+  }
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (queue.size() >= PEER_QUEUE_LIMIT) {
+      dropped++;
+      return;
+    }
+    queue.push_back(std::move(item));
+    max_queue_depth = std::max<uint64_t>(max_queue_depth, queue.size());
+  }
+  cv.notify_one();
+}
+
+void PeerLink::stats(csce662::LinkStats* link) {
+  std::lock_guard<std::mutex> lock(mtx);
+  link->set_peer(address);
+  link->set_posts(posts);
+  link->set_batches(batches);
+  link->set_deliveries(deliveries);
+  link->set_queue_depth(queue.size());
+  link->set_max_queue_depth(max_queue_depth);
+  link->set_dropped(dropped);
+  link->set_seconds(std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count());
+}
+
+std::size_t PeerLink::queueDepth() {
+  std::lock_guard<std::mutex> lock(mtx);
+  return queue.size();
+}
+
+void PeerLink::run() {
+  std::unique_lock<std::mutex> lock(mtx);
+  while (running) {
+    grpc::ClientContext context;
+    Reply reply;
+    active_context = &context;
+    lock.unlock();
+    auto stream = stub->Fanout(&context, &reply);
+    lock.lock();
+
+    bool failed = false;
+    while (true) {
+      cv.wait(lock, [this]() { return !running || !queue.empty(); });
+      if (queue.empty()) {
+        break;  // stopping, and everything queued has been sent
+      }
+      FanoutBatch batch;
+      uint64_t batch_deliveries = 0;
+      while (!queue.empty() && batch.posts_size() < PEER_BATCH_POSTS) {
+        batch_deliveries += queue.front().followers_size();
+        *batch.add_posts() = std::move(queue.front());
+        queue.pop_front();
+      }
+      lock.unlock();
+      bool ok = stream->Write(batch);
+      lock.lock();
+      if (!ok) {
+        dropped += batch.posts_size();
+        failed = true;
+        break;
+      }
+      posts += batch.posts_size();
+      batches++;
+      deliveries += batch_deliveries;
+    }
+
+    lock.unlock();
+    if (!failed) {
+      stream->WritesDone();
+    }
+    grpc::Status status = stream->Finish();
+    if (failed) {
+      log(WARNING, "Fan-out stream to " + address + " failed: " + status.error_message());
+    }
+    lock.lock();
+    active_context = nullptr;
+    if (failed && running) {
+      cv.wait_for(lock, std::chrono::milliseconds(PEER_RETRY_MS), [this]() { return !running; });
+    }
+  }
+}
@@ -0,0 +1,65 @@
+#ifndef PEER_LINK_H
+#define PEER_LINK_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <grpc++/grpc++.h>
+
+#include "sns.grpc.pb.h"
+
+/*
+ * A shard's fan-out link to one other shard. Posts for followers on that
+ * shard are queued here and a sender thread writes them to a long-lived
+ * SNSPeer.Fanout stream. Every write drains the queue into a single batch,
+ * so under load the cost is one stream message per shard per batch rather
+ * than one RPC per follower, and a slow peer only delays its own link.
+ *
+ * The queue is bounded. Posts that don't fit, or that were in a batch when
+ * the stream failed, are dropped and counted; the stream is reopened after
+ * a short pause.
+ */
+class PeerLink
+{
+public:
+  PeerLink(csce662::SNSPeer::Stub* stub, const std::string& address);
+  ~PeerLink();
+
+  PeerLink(const PeerLink&) = delete;
+  PeerLink& operator=(const PeerLink&) = delete;
+
+  // Queue post for followers, users of the other shard; never blocks
+  void enqueue(const csce662::Message& post, std::vector<std::string> followers);
+
+  void stats(csce662::LinkStats* stats);
+  // Posts waiting to be sent
+  std::size_t queueDepth();
+
+private:
+  void run();
+
+  csce662::SNSPeer::Stub* stub;
+  std::string address;
+  std::chrono::steady_clock::time_point started;
+
+  // Guards everything below
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::deque<csce662::FanoutPost> queue;
+  bool running = true;
+  grpc::ClientContext* active_context = nullptr;
+  uint64_t posts = 0;
+  uint64_t batches = 0;
+  uint64_t deliveries = 0;
+  uint64_t max_queue_depth = 0;
+  uint64_t dropped = 0;
+
+  std::thread sender;
+};
+
+#endif
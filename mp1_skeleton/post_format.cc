@@ -0,0 +1,107 @@
+#include "post_format.h"
+
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <regex>
+#include <sstream>
+
+using csce662::Message;
+
+// Convert protobuf Timestamp to valid string format so we can store in .txt files
+std::string timestamp_to_string(const google::protobuf::Timestamp& timestamp) {
+    // Convert Timestamp to std::time_t to use with standard C++ time functions
+    std::time_t raw_time = timestamp.seconds();
+    char buffer[80]={0,};
+
+    // Convert time_t to tm struct for conversion to local time
+    std::tm* timeinfo = std::localtime(&raw_time);
+
+    // Use strftime to format the time into a readable string
+    strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", timeinfo);
+
+    std::stringstream ss;
+    ss << buffer;
+
+    return ss.str();
+}
+
+// We store (username,msg,timestamp,hlc) in the .txt files.
+std::string format_file_output(const std::string& username, const std::string& message, const std::string& timestamp,
+                               uint64_t hlc)
+{
+    std::regex newline_regex("[\r\n]+");  // Regex to match one or more newline characters
+    // Regex to filter out any new lines
+
+    std::stringstream ss;
+    ss << std::regex_replace(username, newline_regex, "") << ","
+       << std::regex_replace(message, newline_regex, "") << ","
+       << std::regex_replace(timestamp, newline_regex, "");
+    if (hlc != 0) {
+        ss << "," << hlc;
+    }
+
+    return ss.str();
+}
+
+// parsing .txt data and pushing them to vector. Split based on (,) (username,msg,timestamp)
+std::vector<std::string> parse_data(const std::string& data) { 
+    std::vector<std::string> components; // vector to store (username,msg,timestamp)
+    std::istringstream ss(data);
+    std::string token;
+
+    while (std::getline(ss, token, ',')) {
+        components.push_back(token); // push to vector
+    }
+
+    return components;
+}
+
+// function to convert time string (2024-09-15 04:55:43) to google protobuf timestamp format
+google::protobuf::Timestamp convert_to_timestamp(const std::string& time_str) {
+    std::tm tm = {};
+    std::istringstream ss(time_str);
+    ss >> std::get_time(&tm, "%Y-%m-%d %H:%M:%S"); // Modify format as needed
+    std::time_t time = mktime(&tm);
+
+    google::protobuf::Timestamp timestamp;
+    timestamp.set_seconds(time);
+    timestamp.set_nanos(0);  // Set nanoseconds if your input includes finer resolution
+
+    return timestamp;
+}
+
+// Build a Message from a (username,msg,timestamp[,hlc]) line of a .txt file
+bool parse_post(const std::string& data_line, Message* response) {
+    auto components = parse_data(data_line); // parse before sending as txt is (username,msg,timestamp,hlc)
+    // A fourth component is the hlc only if it is a number; otherwise it is
+    // the timestamp of an old line whose message had a comma in it
+    bool has_hlc = components.size() == 4 && !components[3].empty() &&
+                   components[3].find_first_not_of("0123456789") == std::string::npos;
+    if (components.size() != 3 && !has_hlc) {  // Ensure there are three components(username,msg,timestamp) and maybe an hlc
+        return false;
+    }
+    response->set_hlc(has_hlc ? std::stoull(components[3]) : 0);
+    response->set_username(components[0]); // set username
+    response->set_msg(components[1]);  // set message
+
+    // Convert the timestamp string to Timestamp
+    auto timestamp = convert_to_timestamp(components[2]);
+    *response->mutable_timestamp() = timestamp; // set timestamp
+    return true;
+}
+
+std::deque<std::pair<uint64_t, std::string>> read_last_lines(const std::string& path, std::size_t count, uint64_t max_lines) {
+    std::deque<std::pair<uint64_t, std::string>> last; // store latest msgs (and their seq) in deque
+    std::ifstream in(path);
+    std::string line;
+    uint64_t seq = 0;
+
+    while (seq < max_lines && getline(in, line)) {
+        last.push_front({++seq, line});
+        if (last.size() > count) {  // get the latest msgs from all users he is following
+            last.pop_back(); // Keep only the last count entries
+        }
+    }
+    return last;
+}
@@ -0,0 +1,39 @@
+#ifndef POST_FORMAT_H
+#define POST_FORMAT_H
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+#include <google/protobuf/timestamp.pb.h>
+
+#include "sns.pb.h"
+
+/*
+ * Helpers for the .txt files the server keeps posts in. Each line of a file
+ * is one post, stored as username,msg,timestamp,hlc; lines written before
+ * posts had an hlc stamp lack the last field.
+ */
+
+// Convert protobuf Timestamp to valid string format so we can store in .txt files
+std::string timestamp_to_string(const google::protobuf::Timestamp& timestamp);
+
+// We store (username,msg,timestamp,hlc) in the .txt files. An hlc of 0 is left out.
+std::string format_file_output(const std::string& username, const std::string& message, const std::string& timestamp,
+                               uint64_t hlc = 0);
+
+// parsing .txt data and pushing them to vector. Split based on (,) (username,msg,timestamp)
+std::vector<std::string> parse_data(const std::string& data);
+
+// function to convert time string (2024-09-15 04:55:43) to google protobuf timestamp format
+google::protobuf::Timestamp convert_to_timestamp(const std::string& time_str);
+
+// Build a Message from a (username,msg,timestamp[,hlc]) line of a .txt file
+bool parse_post(const std::string& data_line, csce662::Message* response);
+
+// The last `count` of the first `max_lines` lines of a file, newest first,
+// each paired with its line number (the post's seq)
+std::deque<std::pair<uint64_t, std::string>> read_last_lines(const std::string& path, std::size_t count, uint64_t max_lines);
+
+#endif
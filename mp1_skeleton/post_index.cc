@@ -0,0 +1,198 @@
+#include "post_index.h"
+
+#include <algorithm>
+#include <cctype>
+#include <mutex>
+
+// Find the first position >= from in `list` whose value is >= target.
+// Probes 1, 2, 4, ... elements ahead and then binary searches the last step,
+// so skipping k elements costs O(log k) instead of O(k).
+static std::size_t gallop(const std::vector<uint32_t>& list, std::size_t from, uint32_t target)
+{
+    std::size_t step = 1;
+    std::size_t hi = from;
+    while (hi < list.size() && list[hi] < target) {
+        from = hi + 1;
+        hi += step;
+        step <<= 1;
+    }
+    hi = std::min(hi, list.size());
+    return std::lower_bound(list.begin() + from, list.begin() + hi, target) - list.begin();
+}
+
+std::vector<std::string> PostIndex::tokenize(const std::string& text)
+{
+    std::vector<std::string> terms;
+    std::string term;
+    for (unsigned char ch : text) {
+        if (std::isalnum(ch)) {
+            term.push_back(std::tolower(ch));
+        } else if (!term.empty()) {
+            terms.push_back(term);
+            term.clear();
+        }
+    }
+    if (!term.empty()) {
+        terms.push_back(term);
+    }
+    return terms;
+}
+
+void PostIndex::appendVarint(std::string& out, uint32_t value)
+{
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+void PostIndex::decodeBlock(const PostingList& list, std::size_t block, std::vector<uint32_t>& out)
+{
+    std::size_t pos = list.skips[block].offset;
+    std::size_t end = block + 1 < list.skips.size() ? list.skips[block + 1].offset : list.bytes.size();
+    out.clear();
+    uint32_t id = 0;
+    while (pos < end) {
+        uint32_t value = 0;
+        int shift = 0;
+        unsigned char byte;
+        do {
+            byte = list.bytes[pos++];
+            value |= static_cast<uint32_t>(byte & 0x7f) << shift;
+            shift += 7;
+        } while (byte & 0x80);
+        id += value;
+        out.push_back(id);
+    }
+}
+
+// Forward-only iterator over a posting list that skips whole blocks
+class PostIndex::Cursor
+{
+public:
+  explicit Cursor(const PostingList& l) : list(l) {}
+
+  // Advance to the first id >= target; false once the list is exhausted
+  bool seek(uint32_t target, uint32_t& found)
+  {
+      const std::vector<Skip>& skips = list.skips;
+      // gallop over the skip entries for the last block starting <= target
+      std::size_t step = 1;
+      std::size_t lo = block;
+      std::size_t hi = block + 1;
+      while (hi < skips.size() && skips[hi].first <= target) {
+          lo = hi;
+          hi += step;
+          step <<= 1;
+      }
+      hi = std::min(hi, skips.size());
+      std::size_t next = std::upper_bound(skips.begin() + lo, skips.begin() + hi, target,
+                                          [](uint32_t t, const Skip& s) { return t < s.first; }) - skips.begin();
+      next = next > lo ? next - 1 : lo;
+      if (next != block || ids.empty()) {
+          block = next;
+          decodeBlock(list, block, ids);
+          pos = 0;
+      }
+      pos = gallop(ids, pos, target);
+      if (pos == ids.size()) {
+          // everything in this block is smaller, so the answer opens the next one
+          if (block + 1 >= skips.size()) {
+              return false;
+          }
+          decodeBlock(list, ++block, ids);
+          pos = 0;
+      }
+      found = ids[pos];
+      return true;
+  }
+
+private:
+  const PostingList& list;
+  std::size_t block = 0;
+  std::vector<uint32_t> ids;  // decoded ids of the current block
+  std::size_t pos = 0;
+};
+
+void PostIndex::add(uint32_t id, const std::string& text)
+{
+    std::vector<std::string> terms = tokenize(text);
+
+    std::unique_lock<std::shared_mutex> lock(mtx);
+    for (const std::string& term : terms) {
+        PostingList& list = postings[term];
+        if (list.count > 0 && list.last >= id) {
+            continue; // term repeated in the same post, or id out of order
+        }
+        if (list.count % BLOCK_SIZE == 0) {
+            // a new block starts with its absolute id so it decodes on its own
+            list.skips.push_back({id, static_cast<uint32_t>(list.bytes.size())});
+            appendVarint(list.bytes, id);
+        } else {
+            appendVarint(list.bytes, id - list.last);
+        }
+        list.last = id;
+        list.count++;
+    }
+}
+
+std::vector<uint32_t> PostIndex::search(const std::vector<std::string>& terms) const
+{
+    std::vector<const PostingList*> lists;
+    std::shared_lock<std::shared_mutex> lock(mtx);
+    for (const std::string& raw : terms) {
+        for (const std::string& term : tokenize(raw)) {
+            auto it = postings.find(term);
+            if (it == postings.end()) {
+                return {}; // a term with no posts matches nothing
+            }
+            lists.push_back(&it->second);
+        }
+    }
+    if (lists.empty()) {
+        return {};
+    }
+
+    // candidates come from the shortest list, so the others are only probed
+    std::sort(lists.begin(), lists.end(),
+              [](const PostingList* a, const PostingList* b) { return a->count < b->count; });
+    std::vector<uint32_t> result;
+    std::vector<uint32_t> block;
+    for (std::size_t b = 0; b < lists[0]->skips.size(); b++) {
+        decodeBlock(*lists[0], b, block);
+        result.insert(result.end(), block.begin(), block.end());
+    }
+    for (std::size_t i = 1; i < lists.size() && !result.empty(); i++) {
+        Cursor cursor(*lists[i]);
+        std::size_t kept = 0;
+        uint32_t found;
+        for (uint32_t id : result) {
+            if (!cursor.seek(id, found)) {
+                break;
+            }
+            if (found == id) {
+                result[kept++] = id;
+            }
+        }
+        result.resize(kept);
+    }
+    return result;
+}
+
+std::size_t PostIndex::termCount() const
+{
+    std::shared_lock<std::shared_mutex> lock(mtx);
+    return postings.size();
+}
+
+std::size_t PostIndex::memoryUsage() const
+{
+    std::shared_lock<std::shared_mutex> lock(mtx);
+    std::size_t bytes = postings.bucket_count() * sizeof(void*);
+    for (const auto& entry : postings) {
+        bytes += sizeof(entry) + entry.first.capacity() + entry.second.bytes.capacity()
+                 + entry.second.skips.capacity() * sizeof(Skip);
+    }
+    return bytes;
+}
@@ -0,0 +1,63 @@
+#ifndef POST_INDEX_H
+#define POST_INDEX_H
+
+#include <cstddef>
+#include <cstdint>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * PostIndex is an in-memory inverted index (term -> posting list of post ids)
+ * used by the Search RPC. It is updated incrementally: every post that goes
+ * through the Timeline path is added once, nothing is ever rebuilt.
+ *
+ * Post ids must be added in increasing order. This lets each posting list be
+ * stored as delta + varint encoded bytes that are only ever appended to. The
+ * list is cut into blocks of BLOCK_SIZE ids, and a skip entry (first id, byte
+ * offset) is kept per block. Queries decode the shortest list and intersect
+ * it against the others with galloping (exponential) search over the skip
+ * entries, decoding only the blocks that may hold a candidate.
+ */
+class PostIndex
+{
+public:
+  // Index every term of `text` under post `id`
+  void add(uint32_t id, const std::string& text);
+
+  // Ids of the posts containing all `terms`, in ascending order
+  std::vector<uint32_t> search(const std::vector<std::string>& terms) const;
+
+  // Split text into lowercase alphanumeric terms
+  static std::vector<std::string> tokenize(const std::string& text);
+
+  // Number of distinct terms, and bytes used by terms + posting lists
+  std::size_t termCount() const;
+  std::size_t memoryUsage() const;
+
+private:
+  static const uint32_t BLOCK_SIZE = 128;
+
+  struct Skip {
+    uint32_t first;   // first id of the block
+    uint32_t offset;  // byte offset of the block in PostingList::bytes
+  };
+
+  struct PostingList {
+    std::string bytes;          // delta + varint encoded post ids
+    std::vector<Skip> skips;    // one entry per BLOCK_SIZE ids
+    uint32_t last = 0;          // last id appended, base for the next delta
+    uint32_t count = 0;         // number of ids in the list
+  };
+
+  class Cursor;
+
+  static void appendVarint(std::string& out, uint32_t value);
+  static void decodeBlock(const PostingList& list, std::size_t block, std::vector<uint32_t>& out);
+
+  std::unordered_map<std::string, PostingList> postings;
+  mutable std::shared_mutex mtx;
+};
+
+#endif
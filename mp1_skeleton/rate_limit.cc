@@ -0,0 +1,22 @@
+#include "rate_limit.h"
+
+#include <algorithm>
+
+bool TokenBucket::take(double rate, double burst) {
+  return take(rate, burst, std::chrono::steady_clock::now());
+}
+
+bool TokenBucket::take(double rate, double burst, std::chrono::steady_clock::time_point now) {
+  std::lock_guard<std::mutex> lock(mtx);
+  if (tokens < 0) {
+    tokens = burst;
+  } else {
+    tokens = std::min(burst, tokens + rate * std::chrono::duration<double>(now - last).count());
+  }
+  last = now;
+  if (tokens < 1) {
+    return false;
+  }
+  tokens -= 1;
+  return true;
+}
@@ -0,0 +1,28 @@
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include <chrono>
+#include <mutex>
+
+/*
+ * Token bucket for per-user rate limits. The bucket refills at rate tokens
+ * per second up to burst tokens, and every operation takes one. The rate
+ * and burst are passed on each call rather than stored, so the server's
+ * limits live in one place and a bucket is just its level and a timestamp.
+ */
+class TokenBucket
+{
+public:
+  // Take a token if one is left after refilling at rate up to burst.
+  // A bucket starts full.
+  bool take(double rate, double burst);
+  // take() at time now, which must not go back between calls
+  bool take(double rate, double burst, std::chrono::steady_clock::time_point now);
+
+private:
+  std::mutex mtx;
+  double tokens = -1;  // -1 until first used, then filled to burst
+  std::chrono::steady_clock::time_point last;
+};
+
+#endif
@@ -0,0 +1,160 @@
+#include "replica_link.h"
+
+#include <algorithm>
+#include <memory>
+
+#include "async_log.h"
+
+using csce662::Mutation;
+using csce662::MutationBatch;
+using csce662::ReplicaAck;
+
+// Mutations queued or unacked before the replica is given up on
+#define REPLICA_QUEUE_LIMIT 1000000
+// Most mutations written in one batch
+#define REPLICA_BATCH_MUTATIONS 512
+// An idle link writes an empty batch this often, so the replica knows the
+// primary is alive
+#define REPLICA_HEARTBEAT_MS 1000
+// Pause before reopening a failed stream
+#define REPLICA_RETRY_MS 500
+
+ReplicaLink::ReplicaLink(csce662::SNSReplica::Stub* s, const std::string& replica_address)
+  : stub(s), address(replica_address) {
+  sender = std::thread(&ReplicaLink::run, this);
+}
+
+ReplicaLink::~ReplicaLink() {
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    running = false;
+    if (active_context) {
+      active_context->TryCancel();
+    }
+  }
+  cv.notify_all();
+  sender.join();
+}
+
+void ReplicaLink::append(Mutation mutation) {
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (!in_sync) {
+      return;
+    }
+    if (queue.size() + unacked.size() >= REPLICA_QUEUE_LIMIT) {
+      loseSync(std::to_string(REPLICA_QUEUE_LIMIT) + " mutations behind");
+      return;
+    }
+    mutation.set_index(next_index++);
+    queue.push_back(std::move(mutation));
+    max_queue_depth = std::max<uint64_t>(max_queue_depth, queue.size());
+  }
+  cv.notify_one();
+}
+
+void ReplicaLink::stats(csce662::ReplicaStats* replica) {
+  std::lock_guard<std::mutex> lock(mtx);
+  replica->set_address(address);
+  replica->set_mutations(mutations);
+  replica->set_batches(batches);
+  replica->set_queue_depth(queue.size());
+  replica->set_unacked(unacked.size());
+  replica->set_max_queue_depth(max_queue_depth);
+  replica->set_in_sync(in_sync);
+}
+
+std::size_t ReplicaLink::queueDepth() {
+  std::lock_guard<std::mutex> lock(mtx);
+  return queue.size();
+}
+
+void ReplicaLink::loseSync(const std::string& reason) {
+  in_sync = false;
+  queue.clear();
+  unacked.clear();
+  if (active_context) {
+    active_context->TryCancel();
+  }
+  cv.notify_all();
+  log(ERROR, "Replica " + address + " is out of sync (" + reason + "); replication stopped");
+}
+
+void ReplicaLink::readAcks(grpc::ClientReaderWriter<MutationBatch, ReplicaAck>* stream) {
+  ReplicaAck ack;
+  while (stream->Read(&ack)) {
+    std::lock_guard<std::mutex> lock(mtx);
+    while (!unacked.empty() && unacked.front().index() <= ack.applied()) {
+      unacked.pop_front();
+    }
+  }
+}
+
+void ReplicaLink::run() {
+  std::unique_lock<std::mutex> lock(mtx);
+  while (running && in_sync) {
+    grpc::ClientContext context;
+    active_context = &context;
+    lock.unlock();
+    std::unique_ptr<grpc::ClientReaderWriter<MutationBatch, ReplicaAck>> stream(stub->Replicate(&context));
+    std::thread acks(&ReplicaLink::readAcks, this, stream.get());
+    lock.lock();
+
+    // What earlier streams sent without an ack goes first
+    std::deque<Mutation> resend(unacked.begin(), unacked.end());
+    bool failed = false;
+    while (true) {
+      MutationBatch batch;
+      if (!resend.empty()) {
+        while (!resend.empty() && batch.mutations_size() < REPLICA_BATCH_MUTATIONS) {
+          *batch.add_mutations() = std::move(resend.front());
+          resend.pop_front();
+        }
+        batch.set_caught_up(false);
+      } else {
+        cv.wait_for(lock, std::chrono::milliseconds(REPLICA_HEARTBEAT_MS),
+                    [this]() { return !running || !in_sync || !queue.empty(); });
+        if (!running || !in_sync) {
+          break;
+        }
+        while (!queue.empty() && batch.mutations_size() < REPLICA_BATCH_MUTATIONS) {
+          *batch.add_mutations() = queue.front();
+          unacked.push_back(std::move(queue.front()));
+          queue.pop_front();
+        }
+        batch.set_caught_up(queue.empty());
+      }
+      batch.set_sent_us(std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::system_clock::now().time_since_epoch()).count());
+      lock.unlock();
+      bool ok = stream->Write(batch);
+      lock.lock();
+      if (!ok) {
+        failed = true;
+        break;
+      }
+      if (batch.mutations_size() > 0) {
+        mutations += batch.mutations_size();
+        batches++;
+      }
+    }
+
+    lock.unlock();
+    if (!failed) {
+      stream->WritesDone();
+    }
+    acks.join();
+    grpc::Status status = stream->Finish();
+    lock.lock();
+    active_context = nullptr;
+    if (!in_sync || !running) {
+      break;
+    }
+    if (status.error_code() == grpc::DATA_LOSS || status.error_code() == grpc::FAILED_PRECONDITION) {
+      loseSync(status.error_message());  // the replica restarted or was promoted
+      break;
+    }
+    log(WARNING, "Replication stream to " + address + " failed: " + status.error_message());
+    cv.wait_for(lock, std::chrono::milliseconds(REPLICA_RETRY_MS), [this]() { return !running; });
+  }
+}
@@ -0,0 +1,71 @@
+#ifndef REPLICA_LINK_H
+#define REPLICA_LINK_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <grpc++/grpc++.h>
+
+#include "sns.grpc.pb.h"
+
+/*
+ * A primary's replication link to one replica: its backup or a read
+ * replica. The service appends every mutation here, numbered in the order
+ * it was applied, and a sender thread writes them in batches to a
+ * long-lived SNSReplica.Replicate stream, so a post costs the primary one
+ * queue push, not a round trip to the replica.
+ *
+ * The replica acks what it has applied. Mutations stay queued until acked
+ * and are resent, in order, on the next stream if one breaks; the replica
+ * skips the ones it already has. When the replica can no longer catch up
+ * (it restarted, or is more than REPLICA_QUEUE_LIMIT mutations behind) the
+ * link gives up on it and replication stops.
+ */
+class ReplicaLink
+{
+public:
+  ReplicaLink(csce662::SNSReplica::Stub* stub, const std::string& address);
+  ~ReplicaLink();
+
+  ReplicaLink(const ReplicaLink&) = delete;
+  ReplicaLink& operator=(const ReplicaLink&) = delete;
+
+  // Number mutation and queue it; never blocks. Callers serialize the
+  // appends of mutations that must be applied in order.
+  void append(csce662::Mutation mutation);
+
+  void stats(csce662::ReplicaStats* stats);
+  // Mutations waiting to be sent
+  std::size_t queueDepth();
+
+private:
+  void run();
+  void readAcks(grpc::ClientReaderWriter<csce662::MutationBatch, csce662::ReplicaAck>* stream);
+  // Caller must hold mtx
+  void loseSync(const std::string& reason);
+
+  csce662::SNSReplica::Stub* stub;
+  std::string address;
+
+  // Guards everything below
+  std::mutex mtx;
+  std::condition_variable cv;
+  // Not sent yet, and sent on the current or an earlier stream but not acked
+  std::deque<csce662::Mutation> queue;
+  std::deque<csce662::Mutation> unacked;
+  uint64_t next_index = 1;
+  bool running = true;
+  bool in_sync = true;
+  grpc::ClientContext* active_context = nullptr;
+  uint64_t mutations = 0;
+  uint64_t batches = 0;
+  uint64_t max_queue_depth = 0;
+
+  std::thread sender;
+};
+
+#endif
@@ -0,0 +1,56 @@
+#include "shard_map.h"
+
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+
+ShardMap::ShardMap(const std::vector<std::string>& addresses) : shards(addresses) {
+  for (std::size_t shard = 0; shard < shards.size(); shard++) {
+    for (int v = 0; v < VNODES; v++) {
+      ring.emplace_back(hash(shards[shard] + "#" + std::to_string(v)), shard);
+    }
+  }
+  std::sort(ring.begin(), ring.end());
+}
+
+ShardMap ShardMap::load(const std::string& path) {
+  std::ifstream in(path);
+  if (!in) {
+    throw std::runtime_error("cannot read shard map " + path);
+  }
+  std::vector<std::string> addresses;
+  std::string line;
+  while (std::getline(in, line)) {
+    line = line.substr(0, line.find('#'));
+    std::size_t start = line.find_first_not_of(" \t\r");
+    if (start == std::string::npos) {
+      continue;
+    }
+    addresses.push_back(line.substr(start, line.find_last_not_of(" \t\r") - start + 1));
+  }
+  if (addresses.empty()) {
+    throw std::runtime_error("shard map " + path + " lists no shards");
+  }
+  return ShardMap(addresses);
+}
+
+std::size_t ShardMap::ownerOf(const std::string& username) const {
+  if (ring.empty()) {
+    return 0;
+  }
+  auto it = std::lower_bound(ring.begin(), ring.end(), std::make_pair(hash(username), std::size_t(0)));
+  return it == ring.end() ? ring.front().second : it->second;
+}
+
+uint64_t ShardMap::hash(const std::string& key) {
+  uint64_t h = 14695981039346656037ULL;  // FNV-1a
+  for (unsigned char c : key) {
+    h ^= c;
+    h *= 1099511628211ULL;
+  }
+  // FNV-1a mixes the last bytes poorly, and vnode keys differ only there
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return h;
+}
@@ -0,0 +1,47 @@
+#ifndef SHARD_MAP_H
+#define SHARD_MAP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+ * Which tsd shard owns which user. Users are placed on a consistent-hash
+ * ring: every shard puts VNODES points on the ring (hashes of its address),
+ * and a user belongs to the first point at or after the hash of their name.
+ * Adding or removing a shard only moves the users next to its points.
+ *
+ * The hash is FNV-1a, not std::hash, so every server and client computes
+ * the same owner whatever it was built with.
+ */
+class ShardMap
+{
+public:
+  ShardMap() {}
+  // One "host:port" per shard; a shard's index is its position
+  explicit ShardMap(const std::vector<std::string>& addresses);
+
+  // Read a shard map file: one host:port per line, # starts a comment.
+  // Throws std::runtime_error if the file can't be read or is empty.
+  static ShardMap load(const std::string& path);
+
+  std::size_t size() const { return shards.size(); }
+  const std::string& address(std::size_t shard) const { return shards[shard]; }
+  const std::vector<std::string>& addresses() const { return shards; }
+
+  // Index of the shard that owns username; 0 if the map is empty
+  std::size_t ownerOf(const std::string& username) const;
+
+  static uint64_t hash(const std::string& key);
+
+private:
+  static const int VNODES = 128;
+
+  std::vector<std::string> shards;
+  // (point, shard), sorted by point
+  std::vector<std::pair<uint64_t, std::size_t>> ring;
+};
+
+#endif
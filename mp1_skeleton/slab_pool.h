@@ -0,0 +1,161 @@
+#ifndef SLAB_POOL_H
+#define SLAB_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+/*
+ * SlabPool hands out objects of type T from slabs of SLAB_SIZE slots instead
+ * of one heap allocation per object. An object is named by a stable handle
+ * (its slot number) and never moves, so pointers to it stay valid until it
+ * is destroyed. Destroyed slots go on a freelist and are reused first.
+ *
+ * create/destroy take a lock; get is lock-free. The slab table has two
+ * levels, a directory of TABLE_CHUNK pointers to chunks of TABLE_CHUNK slab
+ * pointers. A chunk is allocated along with its first slab, and neither
+ * is freed or moved while the pool lives. The directory is small and
+ * allocated up front, yet covers (nearly) every 32-bit handle, so the pool
+ * grows as far as memory allows.
+ */
+template <typename T, std::size_t SLAB_SIZE = 256>
+class SlabPool
+{
+public:
+  typedef uint32_t Handle;
+  static const Handle NONE = UINT32_MAX;
+  static constexpr std::size_t TABLE_CHUNK = 4096;
+  static constexpr std::size_t MAX_SLABS = std::min<std::size_t>(TABLE_CHUNK * TABLE_CHUNK, NONE / SLAB_SIZE);
+
+  SlabPool() : directory(new std::atomic<std::atomic<Slot*>*>[TABLE_CHUNK]) {
+    for (std::size_t i = 0; i < TABLE_CHUNK; i++) {
+      directory[i].store(nullptr, std::memory_order_relaxed);
+    }
+  }
+
+  ~SlabPool() {
+    for (std::size_t s = 0; s < slab_count; s++) {
+      Slot* slab = directory[s / TABLE_CHUNK].load(std::memory_order_relaxed)[s % TABLE_CHUNK].load(std::memory_order_relaxed);
+      for (std::size_t i = 0; i < SLAB_SIZE; i++) {
+        if (slab[i].live) {
+          slab[i].object()->~T();
+        }
+      }
+      delete[] slab;
+    }
+    for (std::size_t c = 0; c * TABLE_CHUNK < slab_count; c++) {
+      delete[] directory[c].load(std::memory_order_relaxed);
+    }
+  }
+
+  SlabPool(const SlabPool&) = delete;
+  SlabPool& operator=(const SlabPool&) = delete;
+
+  // Construct a T in a free slot (reusing destroyed ones first)
+  template <typename... Args>
+  Handle create(Args&&... args) {
+    std::lock_guard<std::mutex> lock(mtx);
+    Handle handle;
+    if (freelist != NONE) {
+      handle = freelist;
+      freelist = slot(handle).next_free;
+    } else {
+      if (next_unused == slab_count * SLAB_SIZE) {
+        if (slab_count == MAX_SLABS) {
+          throw std::bad_alloc();
+        }
+        addSlab();
+      }
+      handle = next_unused++;
+    }
+    Slot& s = slot(handle);
+    try {
+      new (s.storage) T(std::forward<Args>(args)...);
+    } catch (...) {
+      s.next_free = freelist;
+      freelist = handle;
+      throw;
+    }
+    s.live = true;
+    live_count++;
+    return handle;
+  }
+
+  // Destroy the object and put its slot on the freelist
+  void destroy(Handle handle) {
+    std::lock_guard<std::mutex> lock(mtx);
+    Slot& s = slot(handle);
+    if (!s.live) {
+      throw std::logic_error("SlabPool: destroy of a free slot");
+    }
+    s.object()->~T();
+    s.live = false;
+    s.next_free = freelist;
+    freelist = handle;
+    live_count--;
+  }
+
+  T* get(Handle handle) const {
+    return slot(handle).object();
+  }
+
+  std::size_t size() const {
+    std::lock_guard<std::mutex> lock(mtx);
+    return live_count;
+  }
+
+  // Bytes held by the pool itself: the slab table and every slab
+  std::size_t memoryUsage() const {
+    std::lock_guard<std::mutex> lock(mtx);
+    std::size_t chunks = (slab_count + TABLE_CHUNK - 1) / TABLE_CHUNK;
+    return sizeof(*this) + (1 + chunks) * TABLE_CHUNK * sizeof(void*) + slab_count * SLAB_SIZE * sizeof(Slot);
+  }
+
+private:
+  struct Slot {
+    alignas(T) unsigned char storage[sizeof(T)];
+    Handle next_free = NONE;
+    bool live = false;
+    T* object() { return reinterpret_cast<T*>(storage); }
+  };
+
+  Slot& slot(Handle handle) const {
+    std::size_t s = handle / SLAB_SIZE;
+    std::atomic<Slot*>* chunk = directory[s / TABLE_CHUNK].load(std::memory_order_acquire);
+    return chunk[s % TABLE_CHUNK].load(std::memory_order_acquire)[handle % SLAB_SIZE];
+  }
+
+  // Caller must hold mtx
+  void addSlab() {
+    std::atomic<Slot*>* chunk;
+    if (slab_count % TABLE_CHUNK == 0) {
+      chunk = new std::atomic<Slot*>[TABLE_CHUNK];
+      for (std::size_t i = 0; i < TABLE_CHUNK; i++) {
+        chunk[i].store(nullptr, std::memory_order_relaxed);
+      }
+      std::unique_ptr<std::atomic<Slot*>[]> owner(chunk);  // freed if the slab can't be allocated
+      chunk[0].store(new Slot[SLAB_SIZE], std::memory_order_relaxed);
+      directory[slab_count / TABLE_CHUNK].store(owner.release(), std::memory_order_release);
+    } else {
+      chunk = directory[slab_count / TABLE_CHUNK].load(std::memory_order_relaxed);
+      chunk[slab_count % TABLE_CHUNK].store(new Slot[SLAB_SIZE], std::memory_order_release);
+    }
+    slab_count++;
+  }
+
+  std::unique_ptr<std::atomic<std::atomic<Slot*>*>[]> directory;
+  std::size_t slab_count = 0;
+  Handle next_unused = 0;
+  Handle freelist = NONE;
+  std::size_t live_count = 0;
+  mutable std::mutex mtx;
+};
+
+#endif
@@ -0,0 +1,282 @@
+#include "sns_client.h"
+
+#include <chrono>
+#include <ctime>
+#include <utility>
+
+#include "shard_map.h"
+
+using grpc::ClientContext;
+using grpc::Status;
+using csce662::ListReply;
+using csce662::Message;
+using csce662::Reply;
+using csce662::Request;
+using csce662::SNSService;
+using csce662::ShardMapReply;
+
+// Must match the server's (sns_service.cc)
+#define DIRECT_KEY "x-sns-direct"
+#define OWNER_KEY "x-sns-owner"
+// Redirects a call follows before its result is the redirect itself
+#define MAX_REDIRECTS 3
+
+// State of one unary call, freed by its completion callback. start(stub,
+// context, request, reply, callback) sends it; it is sent again, with a
+// fresh context, after each redirect.
+template <typename ReplyT>
+struct PendingCall {
+  std::unique_ptr<ClientContext> context;
+  Request request;
+  ReplyT reply;
+  std::promise<RpcResult<ReplyT>> promise;
+  std::function<void(SNSService::Stub*, ClientContext*, const Request*, ReplyT*, std::function<void(Status)>)> start;
+  int redirects = 0;
+};
+
+namespace {
+
+// A call of request, sent by start
+template <typename ReplyT, typename Start>
+PendingCall<ReplyT>* newCall(Request request, Start start) {
+  auto* call = new PendingCall<ReplyT>;
+  call->request = std::move(request);
+  call->start = start;
+  return call;
+}
+
+// Whether status is a shard refusing a call about another shard's user
+bool isRedirect(const ClientContext& context, const Status& status) {
+  return status.error_code() == grpc::FAILED_PRECONDITION &&
+         context.GetServerTrailingMetadata().count(OWNER_KEY) > 0;
+}
+
+}
+
+SNSClient::SNSClient(std::shared_ptr<grpc::Channel> channel, const std::string& username)
+  : user(username), seed(SNSService::NewStub(channel)), current(seed.get()) {}
+
+Request SNSClient::makeRequest() const {
+  Request request;
+  request.set_username(user);
+  request.set_max_staleness_ms(max_staleness);
+  return request;
+}
+
+void SNSClient::applyTimeout(ClientContext* context) const {
+  if (timeout > 0) {
+    context->set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(timeout));
+  }
+}
+
+void SNSClient::prepareContext(ClientContext* context) const {
+  if (routing) {
+    context->AddMetadata(DIRECT_KEY, "1");
+  }
+}
+
+template <typename ReplyT>
+void SNSClient::issue(PendingCall<ReplyT>* call) {
+  call->context.reset(new ClientContext);
+  applyTimeout(call->context.get());
+  prepareContext(call->context.get());
+  SNSService::Stub* via = stub();
+  call->start(via, call->context.get(), &call->request, &call->reply, [this, call, via](Status status) {
+    if (routing && call->redirects < MAX_REDIRECTS && isRedirect(*call->context, status)) {
+      call->redirects++;
+      call->reply.Clear();
+      refreshRoute(via, [this, call]() { issue(call); });
+      return;
+    }
+    call->promise.set_value(RpcResult<ReplyT>{status, std::move(call->reply)});
+    delete call;
+  });
+}
+
+Status SNSClient::enableRouting() {
+  ClientContext context;
+  applyTimeout(&context);
+  ShardMapReply map;
+  Status status = seed->GetShardMap(&context, makeRequest(), &map);
+  if (status.error_code() == grpc::UNIMPLEMENTED) {
+    return Status::OK;
+  }
+  if (status.ok()) {
+    setRoute(map);
+  }
+  return status;
+}
+
+std::string SNSClient::routedTo() const {
+  std::lock_guard<std::mutex> lock(route_mtx);
+  return owner;
+}
+
+void SNSClient::refreshRoute(SNSService::Stub* via, std::function<void()> then) {
+  struct MapCall {
+    ClientContext context;
+    Request request;
+    ShardMapReply map;
+  };
+  auto* fetch = new MapCall;
+  fetch->request = makeRequest();
+  applyTimeout(&fetch->context);
+  via->async()->GetShardMap(&fetch->context, &fetch->request, &fetch->map, [this, fetch, then](Status status) {
+    if (status.ok()) {
+      setRoute(fetch->map);
+    }
+    delete fetch;
+    then();
+  });
+}
+
+void SNSClient::setRoute(const ShardMapReply& map) {
+  if (map.shards_size() <= 1) {
+    return;  // not sharded: whoever we reached is the server
+  }
+  ShardMap shards(std::vector<std::string>(map.shards().begin(), map.shards().end()));
+  std::string address = shards.address(shards.ownerOf(user));
+  std::lock_guard<std::mutex> lock(route_mtx);
+  std::unique_ptr<SNSService::Stub>& shard_stub = shard_stubs[address];
+  if (!shard_stub) {
+    shard_stub = SNSService::NewStub(grpc::CreateChannel(address, grpc::InsecureChannelCredentials()));
+  }
+  owner = address;
+  current = shard_stub.get();
+  routing = true;
+}
+
+std::future<RpcResult<Reply>> SNSClient::login() {
+  auto* call = newCall<Reply>(makeRequest(), [](SNSService::Stub* stub, auto... args) {
+    stub->async()->Login(args...);
+  });
+  std::future<RpcResult<Reply>> result = call->promise.get_future();
+  issue(call);
+  return result;
+}
+
+std::future<RpcResult<ListReply>> SNSClient::list(uint64_t cursor, uint32_t limit) {
+  Request request = makeRequest();
+  request.set_cursor(cursor);
+  request.set_limit(limit);
+  auto* call = newCall<ListReply>(std::move(request), [](SNSService::Stub* stub, auto... args) {
+    stub->async()->List(args...);
+  });
+  std::future<RpcResult<ListReply>> result = call->promise.get_future();
+  issue(call);
+  return result;
+}
+
+std::future<RpcResult<Reply>> SNSClient::follow(const std::string& followee) {
+  Request request = makeRequest();
+  request.add_arguments(followee);
+  auto* call = newCall<Reply>(std::move(request), [](SNSService::Stub* stub, auto... args) {
+    stub->async()->Follow(args...);
+  });
+  std::future<RpcResult<Reply>> result = call->promise.get_future();
+  issue(call);
+  return result;
+}
+
+std::future<RpcResult<Reply>> SNSClient::unfollow(const std::string& followee) {
+  Request request = makeRequest();
+  request.add_arguments(followee);
+  auto* call = newCall<Reply>(std::move(request), [](SNSService::Stub* stub, auto... args) {
+    stub->async()->UnFollow(args...);
+  });
+  std::future<RpcResult<Reply>> result = call->promise.get_future();
+  issue(call);
+  return result;
+}
+
+std::unique_ptr<TimelineSubscription> SNSClient::subscribe(std::function<void(const Message&)> on_post,
+                                                           uint64_t resume_after,
+                                                           std::function<void(const Status&)> on_done) {
+  return std::unique_ptr<TimelineSubscription>(
+      new TimelineSubscription(this, user, resume_after, std::move(on_post), std::move(on_done)));
+}
+
+TimelineSubscription::TimelineSubscription(SNSClient* client, const std::string& user, uint64_t resume_after,
+                                           std::function<void(const Message&)> post_callback,
+                                           std::function<void(const Status&)> done_callback)
+  : username(user), on_post(std::move(post_callback)), on_done(std::move(done_callback)) {
+  client->prepareContext(&context);
+  client->stub()->async()->Timeline(&context, this);
+  // The first message only tells the server who we are
+  Message initial_message;
+  initial_message.set_username(username);
+  initial_message.set_resume_after(resume_after);
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    outbox.push_back(initial_message);
+    nextWrite();
+  }
+  StartRead(&read_msg);
+  StartCall();
+}
+
+TimelineSubscription::~TimelineSubscription() {
+  close();
+}
+
+void TimelineSubscription::post(Message message) {
+  if (message.username().empty()) {
+    message.set_username(username);
+  }
+  if (!message.has_timestamp()) {
+    message.mutable_timestamp()->set_seconds(time(NULL));
+  }
+  std::lock_guard<std::mutex> lock(mtx);
+  if (finished) {
+    return;
+  }
+  outbox.push_back(std::move(message));
+  if (!writing) {
+    nextWrite();
+  }
+}
+
+void TimelineSubscription::close() {
+  context.TryCancel();
+  wait();
+}
+
+void TimelineSubscription::wait() {
+  std::unique_lock<std::mutex> lock(mtx);
+  cv.wait(lock, [this]() { return finished; });
+}
+
+void TimelineSubscription::nextWrite() {
+  if (outbox.empty()) {
+    return;
+  }
+  write_msg = std::move(outbox.front());
+  outbox.pop_front();
+  writing = true;
+  StartWrite(&write_msg);
+}
+
+void TimelineSubscription::OnWriteDone(bool ok) {
+  std::lock_guard<std::mutex> lock(mtx);
+  writing = false;
+  if (ok) {
+    nextWrite();
+  }
+}
+
+void TimelineSubscription::OnReadDone(bool ok) {
+  if (!ok) {
+    return;
+  }
+  on_post(read_msg);
+  StartRead(&read_msg);
+}
+
+void TimelineSubscription::OnDone(const Status& status) {
+  if (on_done) {
+    on_done(status);
+  }
+  std::lock_guard<std::mutex> lock(mtx);
+  finished = true;
+  cv.notify_all();
+}
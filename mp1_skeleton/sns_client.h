@@ -0,0 +1,156 @@
+#ifndef SNS_CLIENT_H
+#define SNS_CLIENT_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <grpc++/grpc++.h>
+
+#include "sns.grpc.pb.h"
+
+/*
+ * Asynchronous client library for the SNS service (libsnsclient.a).
+ *
+ * Every unary call returns a std::future and is carried by the gRPC callback
+ * API, so no thread blocks while a call is in flight; a caller waits only
+ * when it needs the result. A timeline subscription delivers posts to a
+ * callback from gRPC's own threads, so a process can hold many of them
+ * without a reader thread each.
+ *
+ * Against a sharded cluster the client can route: it fetches the shard map
+ * once and talks straight to the shard that owns its user, instead of
+ * paying for a forwarding hop through whichever shard it first reached.
+ */
+
+// Outcome of one unary call: its status and, if it succeeded, the reply
+template <typename ReplyT>
+struct RpcResult {
+  grpc::Status status;
+  ReplyT reply;
+};
+
+class TimelineSubscription;
+template <typename ReplyT> struct PendingCall;
+
+class SNSClient
+{
+public:
+  SNSClient(std::shared_ptr<grpc::Channel> channel, const std::string& username);
+
+  const std::string& username() const { return user; }
+
+  // Deadline applied to every unary call from now on; 0 means none
+  void setTimeout(int64_t timeout_ms) { timeout = timeout_ms; }
+
+  // Oldest state a read replica may answer list() from; 0 means any
+  void setMaxStaleness(uint32_t staleness_ms) { max_staleness = staleness_ms; }
+
+  // The client must outlive the calls it has in flight
+  std::future<RpcResult<csce662::Reply>> login();
+  // One page of at most limit users from cursor on (limit 0: all of them)
+  std::future<RpcResult<csce662::ListReply>> list(uint64_t cursor = 0, uint32_t limit = 0);
+  std::future<RpcResult<csce662::Reply>> follow(const std::string& followee);
+  std::future<RpcResult<csce662::Reply>> unfollow(const std::string& followee);
+
+  // Enter the timeline. on_post is called for every post delivered,
+  // starting with the history (the last 20 posts, or the posts after
+  // resume_after), on a gRPC thread, one post at a time. A post of ours
+  // the server refused comes back through on_post too, with rejected set.
+  // on_done, if set, is called once when the stream ends.
+  std::unique_ptr<TimelineSubscription> subscribe(std::function<void(const csce662::Message&)> on_post,
+                                                  uint64_t resume_after = 0,
+                                                  std::function<void(const grpc::Status&)> on_done = nullptr);
+
+  // Fetch the shard map through the server this client was made for and,
+  // if that server is one shard of several, send every call from now on
+  // straight to the shard that owns username. A shard whose map disagrees
+  // answers with a redirect; the client then fetches the map again and
+  // retries. Returns the status of the fetch. A server without
+  // GetShardMap is not an error: the client just keeps using it.
+  grpc::Status enableRouting();
+
+  // host:port of the shard calls go to, empty while not routing
+  std::string routedTo() const;
+
+  // Mark context for a call made through stub(), so a shard that doesn't
+  // own username redirects it rather than forwarding it
+  void prepareContext(grpc::ClientContext* context) const;
+
+  // The stub calls go to, for calls the library doesn't wrap. It stays
+  // valid for the life of the client, even after the route changes.
+  csce662::SNSService::Stub* stub() const { return current.load(); }
+
+private:
+  csce662::Request makeRequest() const;
+  void applyTimeout(grpc::ClientContext* context) const;
+  // Start call, or start it again after a redirect
+  template <typename ReplyT> void issue(PendingCall<ReplyT>* call);
+  // Fetch the shard map through via, update the route, then run then
+  void refreshRoute(csce662::SNSService::Stub* via, std::function<void()> then);
+  void setRoute(const csce662::ShardMapReply& map);
+
+  std::string user;
+  std::unique_ptr<csce662::SNSService::Stub> seed;
+  std::atomic<csce662::SNSService::Stub*> current;
+  std::atomic<bool> routing{false};
+  // Guards owner and shard_stubs
+  mutable std::mutex route_mtx;
+  std::string owner;
+  // Stubs of the shards routed to so far by address. They are never
+  // dropped, so a call in flight keeps its stub through a route change.
+  std::unordered_map<std::string, std::unique_ptr<csce662::SNSService::Stub>> shard_stubs;
+  int64_t timeout = 0;
+  uint32_t max_staleness = 0;
+};
+
+// A live Timeline stream. Destroying it closes the stream.
+class TimelineSubscription : public grpc::ClientBidiReactor<csce662::Message, csce662::Message>
+{
+public:
+  ~TimelineSubscription();
+
+  // Post a message. Username and timestamp are filled in if unset. Posts are
+  // written in order; this never blocks.
+  void post(csce662::Message message);
+
+  // Cancel the stream and wait until it has ended
+  void close();
+
+  // Wait until the stream has ended, by close() or by the server
+  void wait();
+
+  void OnWriteDone(bool ok) override;
+  void OnReadDone(bool ok) override;
+  void OnDone(const grpc::Status& status) override;
+
+private:
+  friend class SNSClient;
+  TimelineSubscription(SNSClient* client, const std::string& username, uint64_t resume_after,
+                       std::function<void(const csce662::Message&)> on_post,
+                       std::function<void(const grpc::Status&)> on_done);
+
+  // Caller must hold mtx
+  void nextWrite();
+
+  std::string username;
+  std::function<void(const csce662::Message&)> on_post;
+  std::function<void(const grpc::Status&)> on_done;
+  grpc::ClientContext context;
+  csce662::Message read_msg;
+  csce662::Message write_msg;
+  // Guards outbox, writing and finished. Only one write may be in flight.
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::deque<csce662::Message> outbox;
+  bool writing = false;
+  bool finished = false;
+};
+
+#endif
@@ -0,0 +1,1392 @@
+#include "sns_service.h"
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <thread>
+#include <google/protobuf/timestamp.pb.h>
+
+#include "post_format.h"
+#include "latency_stats.h"
+#include "work_class.h"
+#include "async_log.h"
+
+using grpc::ClientContext;
+using grpc::ServerContext;
+using grpc::ServerReader;
+using grpc::ServerReaderWriter;
+using grpc::Status;
+using csce662::Message;
+using csce662::ListReply;
+using csce662::Request;
+using csce662::Reply;
+using csce662::FollowBatchRequest;
+using csce662::FollowBatchReply;
+using csce662::FollowOp;
+using csce662::FollowResult;
+using csce662::FanoutBatch;
+using csce662::FanoutPost;
+using csce662::Mutation;
+using csce662::MutationBatch;
+using csce662::ReplicaAck;
+using csce662::SearchReply;
+using csce662::StatsReply;
+using csce662::SNSService;
+using csce662::SNSPeer;
+using csce662::SNSReplica;
+
+namespace fs = std::filesystem;
+
+// Wall-clock time in microseconds, as used by the trace fields of Message
+int64_t now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+int64_t steady_now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+SNSServiceImpl::SNSServiceImpl(const std::string& dir, const ShardMap& shards, std::size_t index)
+  : data_dir(dir), shard_map(shards), shard_index(index) {
+    for (std::size_t shard = 0; shard < shard_map.size(); shard++) {
+        if (shard == shard_index) {
+            shard_stubs.emplace_back();
+            peer_stubs.emplace_back();
+            peer_links.emplace_back();
+            continue;
+        }
+        auto channel = grpc::CreateChannel(shard_map.address(shard), grpc::InsecureChannelCredentials());
+        shard_stubs.push_back(SNSService::NewStub(channel));
+        peer_stubs.push_back(SNSPeer::NewStub(channel));
+        peer_links.emplace_back(new PeerLink(peer_stubs.back().get(), shard_map.address(shard)));
+    }
+
+    // Delete the .txt files of the previous session, since none of its users exist any more
+    try {
+        for (const auto& entry : fs::directory_iterator(data_dir)) {
+            if (entry.is_regular_file() && entry.path().extension() == ".txt") {
+                fs::remove(entry.path());
+            }
+        }
+    } catch (const fs::filesystem_error& e) {
+        std::cerr << "Filesystem error: " << e.what() << std::endl;
+    } catch (const std::exception& e) {
+        std::cerr << "General error: " << e.what() << std::endl;
+    }
+}
+
+SNSServiceImpl::~SNSServiceImpl() {
+    {
+      std::lock_guard<std::mutex> lock(stop_mutex);
+      stopping = true;
+    }
+    stop_cv.notify_all();
+    if (watchdog.joinable()) {
+        watchdog.join();
+    }
+    if (reaper.joinable()) {
+        reaper.join();
+    }
+}
+
+// How often the reaper looks at the open streams
+#define REAP_INTERVAL_S 5
+
+void SNSServiceImpl::start_reaper(int idle_s, int stall_s) {
+    if (idle_s > 0 || stall_s > 0) {
+        reaper = std::thread(&SNSServiceImpl::run_reaper, this, idle_s, stall_s);
+    }
+}
+
+void SNSServiceImpl::run_reaper(int idle_s, int stall_s) {
+    std::unique_lock<std::mutex> lock(stop_mutex);
+    while (true) {
+        if (stop_cv.wait_for(lock, std::chrono::seconds(REAP_INTERVAL_S), [this]() { return stopping; })) {
+            return;
+        }
+        // sweep without stop_mutex, so shutdown doesn't wait behind the
+        // sweep or its background slot
+        lock.unlock();
+        reap(idle_s, stall_s);
+        lock.lock();
+    }
+}
+
+// Cancelling a stream's context fails its blocked Write and its Read, so
+// its Timeline handler cleans up and returns as if the client had left
+void SNSServiceImpl::reap(int idle_s, int stall_s) {
+    work_class::Slot slot(work_class::BACKGROUND);
+    int64_t now = steady_now_ns();
+    std::lock_guard<std::mutex> lock(live_mutex);
+    for (Connection* connection : live_connections) {
+        if (connection->reaped) {
+            continue;
+        }
+        int64_t write_since = connection->write_since_ns;
+        bool stalled = stall_s > 0 && write_since > 0 && now - write_since > stall_s * 1000000000LL;
+        bool idle = idle_s > 0 && now - connection->last_active_ns > idle_s * 1000000000LL;
+        if (stalled || idle) {
+            connection->reaped = true;
+            connection->context->TryCancel();
+            streams_reaped++;
+            log(WARNING, "Reaped " << (stalled ? "stalled" : "idle") << " Timeline stream of " << connection->username);
+        }
+    }
+}
+
+// Initial metadata of a Timeline stream from a read replica: staleness_ms()
+// when the stream opened
+#define STALENESS_KEY "x-sns-staleness-ms"
+
+// What a replica answers the calls it doesn't serve until it is promoted
+Status standby_status() {
+    return Status(grpc::UNAVAILABLE, "This server is a replica; use the primary");
+}
+
+// A replica is current as of the last caught-up batch it applied; both
+// times are wall clocks, so this assumes the primary's is in step
+uint64_t SNSServiceImpl::staleness_ms() const {
+    if (!standby) {
+        return 0;
+    }
+    return std::max<int64_t>(0, now_us() - fresh_as_of_us) / 1000;
+}
+
+Status SNSServiceImpl::check_read(uint32_t max_staleness_ms) const {
+    if (!standby) {
+        return Status::OK;
+    }
+    if (!read_replica) {
+        return standby_status();
+    }
+    uint64_t staleness = staleness_ms();
+    if (max_staleness_ms > 0 && staleness > max_staleness_ms) {
+        return Status(grpc::UNAVAILABLE, "Replica is " + std::to_string(staleness) + "ms behind the primary");
+    }
+    return Status::OK;
+}
+
+void SNSServiceImpl::replicate_to(const std::string& replica_address) {
+    replica_stubs.push_back(SNSReplica::NewStub(grpc::CreateChannel(replica_address, grpc::InsecureChannelCredentials())));
+    replica_links.emplace_back(new ReplicaLink(replica_stubs.back().get(), replica_address));
+}
+
+// Send a mutation to every replica. Callers serialize mutations that must
+// be applied in order, as ReplicaLink::append requires.
+void SNSServiceImpl::replicate(Mutation mutation) {
+    for (std::size_t i = 0; i + 1 < replica_links.size(); i++) {
+        replica_links[i]->append(mutation);
+    }
+    if (!replica_links.empty()) {
+        replica_links.back()->append(std::move(mutation));
+    }
+}
+
+void SNSServiceImpl::stand_by(int promote_after_s, bool serve_reads) {
+    standby = true;
+    read_replica = serve_reads;
+    last_replication_ns = steady_now_ns();
+    fresh_as_of_us = now_us();
+    if (promote_after_s > 0) {
+        watchdog = std::thread(&SNSServiceImpl::watch_primary, this, promote_after_s);
+    }
+}
+
+void SNSServiceImpl::promote() {
+    std::lock_guard<std::mutex> lock(replication_mutex);
+    if (standby) {
+        standby = false;
+        log(WARNING, "Promoted to primary after " + std::to_string(applied) + " replicated mutations");
+    }
+}
+
+// Promote once no batch or heartbeat has come from the primary for
+// promote_after_s seconds
+void SNSServiceImpl::watch_primary(int promote_after_s) {
+    std::unique_lock<std::mutex> lock(stop_mutex);
+    while (standby && !stopping) {
+        stop_cv.wait_for(lock, std::chrono::seconds(1));
+        int64_t silent_ns = steady_now_ns() - last_replication_ns;
+        if (standby && !stopping && silent_ns > promote_after_s * 1000000000LL) {
+            log(WARNING, "No word from the primary for " + std::to_string(promote_after_s) + "s");
+            promote();
+        }
+    }
+}
+
+std::string SNSServiceImpl::data_path(const std::string& file) const {
+    return (fs::path(data_dir) / file).string();
+}
+
+#define RECENT_CACHE_SIZE 100
+// A failover resume reads back at most this many of the newest posts
+#define HLC_REPLAY_LIMIT 1000
+#define MAX_FOLLOW_BATCH 10000
+// A user's rate limit allows bursts of this many seconds' worth
+#define RATE_BURST_S 10
+// Weight of the newest append in the storage write average: 1/16
+#define STORAGE_EWMA_SHIFT 4
+// Set on calls whose sender picked this shard as the user's owner: calls
+// forwarded by another shard, and calls from routing clients. Such a call
+// for a user this shard doesn't own is refused with a redirect instead of
+// being forwarded, so shards with different shard maps can't bounce a call
+// between them and a client with a stale map learns to refresh it.
+#define DIRECT_KEY "x-sns-direct"
+// Trailing metadata of a redirect: host:port of the owning shard
+#define OWNER_KEY "x-sns-owner"
+
+// Context for a call made to another shard on behalf of a client: it has
+// the client's deadline, is cancelled with it, and is marked as direct
+std::unique_ptr<ClientContext> forward_context(ServerContext* context) {
+    std::unique_ptr<ClientContext> forward = ClientContext::FromServerContext(*context);
+    forward->AddMetadata(DIRECT_KEY, "1");
+    return forward;
+}
+
+bool direct(ServerContext* context) {
+    return context->client_metadata().count(DIRECT_KEY) > 0;
+}
+
+// The redirect status for a direct call about another shard's user
+Status SNSServiceImpl::wrong_shard(ServerContext* context, const std::string& username) const {
+    context->AddTrailingMetadata(OWNER_KEY, shard_map.address(shard_map.ownerOf(username)));
+    return Status(grpc::FAILED_PRECONDITION, "User " + username + " is not on this shard");
+}
+
+template <typename Call>
+bool SNSServiceImpl::route(ServerContext* context, const std::string& username, Status* status, Call call) {
+    if (owns(username)) {
+        return false;
+    }
+    if (direct(context)) {
+        *status = wrong_shard(context, username);
+        return true;
+    }
+    std::unique_ptr<ClientContext> forward = forward_context(context);
+    *status = call(shard_stubs[shard_map.ownerOf(username)].get(), forward.get());
+    return true;
+}
+
+// The stand-in record of a user owned by another shard, created on first
+// use. Caller must hold client_db_mutex.
+Client* SNSServiceImpl::remote_client_locked(const std::string& username, std::size_t shard) {
+    Client* client = find_client(username);
+    if (client == nullptr) {
+        client = client_pool.get(client_pool.create());
+        client->username = username;
+        client->remote_shard = shard;
+        client_index[username] = client;  // not in client_db, which holds this shard's users
+    }
+    return client;
+}
+
+// Follow or unfollow for a sharded cluster. The follower's shard handles
+// the call; the followee's shard keeps the follower list that its posts fan
+// out to, so when that is another shard it is asked first and has the say.
+Status SNSServiceImpl::apply_follow(const FollowOp& op, ServerContext* context) {
+    Status status;
+    if (route(context, op.follower(), &status, [&op](SNSService::Stub* stub, ClientContext* forward) {
+            Request request;
+            request.set_username(op.follower());
+            request.add_arguments(op.followee());
+            Reply reply;
+            return op.unfollow() ? stub->UnFollow(forward, request, &reply) : stub->Follow(forward, request, &reply);
+        })) {
+        return status;
+    }
+    std::size_t followee_shard = shard_map.ownerOf(op.followee());
+    if (followee_shard == shard_index) {
+        std::lock_guard<std::mutex> lock(client_db_mutex);
+        Client* follower = find_client(op.follower());
+        Client* followee = find_client(op.followee());
+        status = admit_follow_locked(follower);
+        if (!status.ok()) {
+            return status;
+        }
+        return op.unfollow() ? unfollow_locked(follower, followee) : follow_locked(follower, followee);
+    }
+    {
+        std::lock_guard<std::mutex> lock(client_db_mutex);
+        Client* follower = find_client(op.follower());
+        if (follower == nullptr) {
+            return Status::CANCELLED;
+        }
+        status = admit_follow_locked(follower);
+        if (!status.ok()) {
+            return status;
+        }
+    }
+    FollowResult result;
+    status = peer_stubs[followee_shard]->UpdateFollower(forward_context(context).get(), op, &result);
+    if (!status.ok()) {
+        return status;
+    }
+    if (result.code() != grpc::OK) {
+        return Status(static_cast<grpc::StatusCode>(result.code()), result.error());
+    }
+    std::lock_guard<std::mutex> lock(client_db_mutex);
+    Client* follower = find_client(op.follower());
+    Client* followee = remote_client_locked(op.followee(), followee_shard);
+    if (op.unfollow()) {
+        unfollow_locked(follower, followee);
+    } else {
+        follow_locked(follower, followee);
+    }
+    return Status::OK;
+}
+
+// List for a sharded cluster: every shard's users, shard by shard. There is
+// no cluster-wide registry order to page through, so the whole list is
+// returned every time with next_cursor 0, telling clients to start over.
+Status SNSServiceImpl::list_sharded(Client* client, ListReply* list_reply) {
+    for (std::size_t shard = 0; shard < shard_map.size(); shard++) {
+        if (shard == shard_index) {
+            std::lock_guard<std::mutex> lock(client_db_mutex);
+            for (Client* user : client_db) {
+                list_reply->add_all_users(user->username);
+            }
+            continue;
+        }
+        ClientContext context;
+        Request request;
+        ListReply users;
+        Status status = peer_stubs[shard]->LocalUsers(&context, request, &users);
+        if (!status.ok()) {
+            return Status(grpc::UNAVAILABLE, "Shard " + shard_map.address(shard) + ": " + status.error_message());
+        }
+        for (const auto& user : users.all_users()) {
+            list_reply->add_all_users(user);
+        }
+    }
+    std::lock_guard<std::mutex> lock(client_db_mutex);
+    for (Client* followers : client->client_followers) {
+        list_reply->add_followers(followers->username);
+    }
+    list_reply->set_version(0);
+    list_reply->set_next_cursor(0);
+    list_reply->set_has_more(false);
+    return Status::OK;
+}
+
+// Timeline of a user owned by another shard: relay the stream to and from
+// the owner, which holds the user's state
+Status SNSServiceImpl::proxy_timeline(ServerContext* context, ServerReaderWriter<Message, Message>* stream,
+                                      const Message& first) {
+    if (direct(context)) {
+        return wrong_shard(context, first.username());
+    }
+    std::unique_ptr<ClientContext> forward = forward_context(context);
+    auto upstream = shard_stubs[shard_map.ownerOf(first.username())]->Timeline(forward.get());
+    if (!upstream->Write(first)) {
+        return upstream->Finish();
+    }
+    std::thread downstream([&]() {
+        Message message;
+        while (upstream->Read(&message) && stream->Write(message)) {
+        }
+        context->TryCancel();  // the owner is gone; end the client's stream too
+    });
+    Message message;
+    while (stream->Read(&message) && upstream->Write(message)) {
+    }
+    upstream->WritesDone();
+    downstream.join();
+    return upstream->Finish();
+}
+
+// Find a client object by username. Caller must hold client_db_mutex.
+Client* SNSServiceImpl::find_client(const std::string& username) {
+    auto it = client_index.find(username);
+    return it == client_index.end() ? nullptr : it->second;
+}
+
+// Make follower follow to_follow. Caller must hold client_db_mutex.
+Status SNSServiceImpl::follow_locked(Client* follower, Client* to_follow) {
+    if (follower == nullptr || to_follow == nullptr) { // if either user doesn't exist
+        return Status::CANCELLED;
+    }
+    if(to_follow==follower) // followee and follower are same
+    {
+        return Status(grpc::ALREADY_EXISTS,"followee and follower are same");
+    }
+
+    // check if user we need to follow already followed or not
+    if(std::find(follower->client_following.begin(), follower->client_following.end(), to_follow) == follower->client_following.end()) {
+        follower->client_following.push_back(to_follow); // add the client we need to follow in client_following
+        to_follow->client_followers.push_back(follower); // add the follower to the followers list of the one we follow
+        replicate_follow(follower, to_follow, false);
+        return Status::OK;
+    }
+    return Status(grpc::ALREADY_EXISTS,"Already followed");
+}
+
+// Make follower stop following to_unfollow. Caller must hold client_db_mutex.
+Status SNSServiceImpl::unfollow_locked(Client* follower, Client* to_unfollow) {
+    if (follower == nullptr || to_unfollow == nullptr) { // if either user doesn't exist
+        return Status::CANCELLED;
+    }
+    if(to_unfollow==follower) // followee and follower are same
+    {
+        return Status(grpc::ALREADY_EXISTS,"followee and follower are same");
+    }
+    if(std::find(follower->client_following.begin(), follower->client_following.end(), to_unfollow) != follower->client_following.end())
+    {
+        follower->client_following.erase(std::remove(follower->client_following.begin(), follower->client_following.end(), to_unfollow), follower->client_following.end());
+        to_unfollow->client_followers.erase(std::remove(to_unfollow->client_followers.begin(), to_unfollow->client_followers.end(), follower), to_unfollow->client_followers.end());
+        replicate_follow(follower, to_unfollow, true);
+        return Status::OK;
+    }
+    return Status(grpc::ALREADY_EXISTS,"Already Unfollowed");
+}
+
+// Send an edge change to the replicas. Caller must hold client_db_mutex,
+// which orders it with the logins and other edges it depends on.
+void SNSServiceImpl::replicate_follow(Client* follower, Client* followee, bool unfollow) {
+    if (replicating()) {
+        Mutation mutation;
+        FollowOp* op = mutation.mutable_follow();
+        op->set_follower(follower->username);
+        op->set_followee(followee->username);
+        op->set_unfollow(unfollow);
+        replicate(std::move(mutation));
+    }
+}
+
+#define MAX_SEARCH_RESULTS 20
+
+Connection::Connection(ServerReaderWriter<Message, Message>* s, ServerContext* c)
+  : stream(s), context(c), last_active_ns(steady_now_ns()) {}
+
+void Connection::push(std::shared_ptr<const Message> post) {
+    {
+      std::lock_guard<std::mutex> lock(outbox_mutex);
+      if (closing) {
+          return;
+      }
+      if (outbox.size() >= STREAM_OUTBOX_LIMIT + history_queued) {
+          if (!overflowed.exchange(true)) {
+              log(WARNING, "Timeline stream of " + username + " fell " + std::to_string(STREAM_OUTBOX_LIMIT) + " posts behind; closing it");
+              context->TryCancel();  // the client resumes from its last seq
+          }
+          return;
+      }
+      outbox.push_back(std::move(post));
+    }
+    outbox_cv.notify_one();
+}
+
+void Connection::push_history(std::shared_ptr<const Message> post) {
+    std::lock_guard<std::mutex> lock(outbox_mutex);
+    outbox.push_back(std::move(post));
+    history_queued++;
+}
+
+void Connection::start_writer() {
+    writer = std::thread(&Connection::run_writer, this);
+}
+
+void Connection::stop_writer() {
+    {
+      std::lock_guard<std::mutex> lock(outbox_mutex);
+      closing = true;
+      outbox.clear();
+      history_queued = 0;
+    }
+    outbox_cv.notify_one();
+    writer.join();
+}
+
+void Connection::run_writer() {
+    // Held while the history at the front of the outbox is written, so the
+    // HISTORY class bounds replay traffic to the clients too, not only
+    // reading it. Released with the last post of history.
+    std::unique_ptr<work_class::Slot> history_slot;
+    std::unique_lock<std::mutex> lock(outbox_mutex);
+    while (true) {
+        outbox_cv.wait(lock, [this]() { return closing || !outbox.empty(); });
+        if (closing) {
+            return;
+        }
+        if (history_queued > 0 && !history_slot) {
+            lock.unlock();
+            history_slot.reset(new work_class::Slot(work_class::HISTORY));
+            lock.lock();
+            continue;  // the stream may have closed meanwhile
+        }
+        std::shared_ptr<const Message> post = std::move(outbox.front());
+        outbox.pop_front();
+        bool last_history = false;
+        if (history_queued > 0) {
+            last_history = --history_queued == 0;
+        }
+        lock.unlock();
+        write_since_ns = steady_now_ns();
+        bool ok;
+        if (post->has_trace()) {
+            // the shared post is immutable; stamp this stream's copy
+            Message traced(*post);
+            traced.mutable_trace()->set_server_write_us(now_us());
+            ok = stream->Write(traced);
+        } else {
+            ok = stream->Write(*post);
+        }
+        write_since_ns = 0;
+        last_active_ns = steady_now_ns();
+        if (last_history) {
+            history_slot.reset();
+        }
+        lock.lock();
+        if (!ok) {
+            return;  // the stream is gone; the handler's Read fails too
+        }
+    }
+}
+
+// Log how many bytes each user costs: their pooled Client record, the heap
+// memory it points to (name, follow lists, recent posts) and their share of
+// the username index. Caller must hold client_db_mutex.
+void SNSServiceImpl::log_memory_report() {
+    std::size_t heap_bytes = 0;
+    for (Client* c : client_db) {
+        std::lock_guard<std::mutex> lock(c->mtx);
+        heap_bytes += c->username.capacity() > 15 ? c->username.capacity() + 1 : 0;
+        heap_bytes += (c->client_followers.capacity() + c->client_following.capacity()) * sizeof(Client*);
+        for (const Message& post : c->recent) {
+            heap_bytes += post.SpaceUsedLong();
+        }
+    }
+    std::size_t index_bytes = client_index.bucket_count() * sizeof(void*)
+        + client_index.size() * (sizeof(std::pair<const std::string, Client*>) + sizeof(void*) + sizeof(std::size_t));
+    std::size_t pool_bytes = client_pool.memoryUsage();
+    std::size_t users = std::max<std::size_t>(client_db.size(), 1);
+    log(INFO, "Memory: " + std::to_string(client_db.size()) + " users, "
+        + std::to_string((pool_bytes + heap_bytes + index_bytes) / users) + " bytes/user (pool "
+        + std::to_string(pool_bytes / users) + ", heap " + std::to_string(heap_bytes / users)
+        + ", index " + std::to_string(index_bytes / users) + "), "
+        + std::to_string(connection_pool.size()) + " open streams using "
+        + std::to_string(connection_pool.memoryUsage()) + " bytes");
+}
+
+// Log the memory report, taking the registry lock
+void SNSServiceImpl::memory_report() {
+    std::lock_guard<std::mutex> lock(client_db_mutex);
+    log_memory_report();
+}
+
+void SNSServiceImpl::set_rate_limits(double posts_per_s, double follows_per_s) {
+    post_rate = posts_per_s;
+    follow_rate = follows_per_s;
+}
+
+void SNSServiceImpl::set_admission(uint64_t backlog_limit, double write_ms_limit) {
+    max_backlog = backlog_limit;
+    max_write_ms = write_ms_limit;
+}
+
+uint64_t SNSServiceImpl::backlog() {
+    uint64_t depth = 0;
+    for (const auto& link : peer_links) {
+        if (link) {
+            depth += link->queueDepth();
+        }
+    }
+    for (const auto& link : replica_links) {
+        depth += link->queueDepth();
+    }
+    return depth;
+}
+
+// Shed writes while the server is behind, before they add fan-out and
+// file appends that would slow every user down
+Status SNSServiceImpl::admit() {
+    if (max_backlog > 0) {
+        uint64_t depth = backlog();
+        if (depth > max_backlog) {
+            shed++;
+            return Status(grpc::RESOURCE_EXHAUSTED, "Server overloaded: " + std::to_string(depth) + " posts queued; try again later");
+        }
+    }
+    if (max_write_ms > 0 && storage_write_ns > max_write_ms * 1000000) {
+        shed++;
+        return Status(grpc::RESOURCE_EXHAUSTED, "Server overloaded: storage is slow; try again later");
+    }
+    return Status::OK;
+}
+
+Status SNSServiceImpl::admit_post(Client* poster) {
+    Status status = admit();
+    if (!status.ok()) {
+        return status;
+    }
+    if (post_rate > 0 && !poster->post_bucket.take(post_rate, post_rate * RATE_BURST_S)) {
+        rate_limited_posts++;
+        return Status(grpc::RESOURCE_EXHAUSTED, "Over " + std::to_string((int)post_rate) + " posts per second");
+    }
+    return Status::OK;
+}
+
+Status SNSServiceImpl::admit_follow_locked(Client* follower) {
+    Status status = admit();
+    if (!status.ok() || follower == nullptr) {
+        return status;  // an unknown user fails later, as before
+    }
+    if (follow_rate > 0 && !follower->follow_bucket.take(follow_rate, follow_rate * RATE_BURST_S)) {
+        rate_limited_follows++;
+        return Status(grpc::RESOURCE_EXHAUSTED, "Over " + std::to_string((int)follow_rate) + " follows per second");
+    }
+    return Status::OK;
+}
+
+// Concurrent appenders may overwrite each other's update; the average only
+// needs to follow the trend
+void SNSServiceImpl::note_storage_write(std::chrono::steady_clock::time_point start) {
+    int64_t sample = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    int64_t average = storage_write_ns.load(std::memory_order_relaxed);
+    storage_write_ns.store(average + ((sample - average) >> STORAGE_EWMA_SHIFT), std::memory_order_relaxed);
+}
+
+// Keep a post made by one of this server's users: append it to the
+// poster's file and add it to post_db and the search index
+void SNSServiceImpl::store_post(const Message& post, const std::string& ffo) {
+    std::chrono::steady_clock::time_point write_start = std::chrono::steady_clock::now();
+    std::ofstream user_file(data_path(post.username() + ".txt"), std::ios::app);
+    user_file << ffo << std::endl;
+    user_file.close();
+    note_storage_write(write_start);
+    // Ids must reach the index in increasing order, so this is done under
+    // the post_db lock
+    std::lock_guard<std::mutex> lock(post_db_mutex);
+    post_index.add(post_db.size(), post.msg());
+    post_db.push_back(post);
+    post_db.back().clear_trace();
+}
+
+// Deliver a post to one follower: give it the follower's next sequence
+// number, append it to their following file and, if they are in timeline
+// mode, queue it on each of their streams. post is stamped with the
+// follower's seq in place; the follower gets copies of it, one for their
+// recent cache and one shared by all of their streams. Only queues, so it
+// never waits on a client.
+void SNSServiceImpl::deliver_post(Client* follower, Message* post, const std::string& ffo) {
+    std::lock_guard<std::mutex> lock(follower->mtx);
+    post->set_seq(++follower->following_file_size);
+
+    std::chrono::steady_clock::time_point write_start = std::chrono::steady_clock::now();
+    std::ofstream fout(data_path(follower->username + "_following.txt"), std::ios::app);
+    fout << ffo << std::endl;
+    fout.close();
+    note_storage_write(write_start);
+
+    follower->recent.push_back(*post);
+    follower->recent.back().clear_trace();  // a replay is not this delivery
+    if (follower->recent.size() > RECENT_CACHE_SIZE) {
+        follower->evicted_hlc = std::max(follower->evicted_hlc, follower->recent.front().hlc());
+        follower->recent.pop_front();
+    }
+    if (!follower->connections.empty()) {
+        // One copy shared by all of the follower's streams
+        std::shared_ptr<const Message> shared = std::make_shared<const Message>(*post);
+        for (Connection* connection : follower->connections) {
+            connection->push(shared);  // Forward the message to the follower
+        }
+    }
+}
+
+// Queue the posts after sequence number resume_after for a reconnecting
+// client, oldest first. Caller must hold client->mtx.
+void SNSServiceImpl::replay_posts(Client* client, uint64_t resume_after, Connection* connection) {
+    if (resume_after >= client->following_file_size) {
+        return; // nothing was missed
+    }
+    if (!client->recent.empty() && client->recent.front().seq() <= resume_after + 1) {
+        for (const Message& post : client->recent) {
+            if (post.seq() > resume_after) {
+                connection->push_history(std::make_shared<const Message>(post));
+            }
+        }
+        return;
+    }
+    // the gap is older than the cache, so read it back from the following file
+    std::ifstream in(data_path(client->username + "_following.txt"));
+    std::string line;
+    uint64_t seq = 0;
+    while (seq < client->following_file_size && getline(in, line)) {
+        if (++seq <= resume_after) {
+            continue;
+        }
+        std::shared_ptr<Message> response = std::make_shared<Message>();
+        if (parse_post(line, response.get())) {
+            response->set_seq(seq);
+            connection->push_history(std::move(response));
+        }
+    }
+}
+
+// Queue the posts stamped after resume_after_hlc, oldest first by hlc, for
+// a client that failed over from another server and so has no seq of ours.
+// A client away longer than HLC_REPLAY_LIMIT posts gets only the newest
+// ones. Caller must hold client->mtx.
+void SNSServiceImpl::replay_posts_after_hlc(Client* client, uint64_t resume_after_hlc, Connection* connection) {
+    std::vector<std::shared_ptr<const Message>> missed;
+    if (client->evicted_hlc <= resume_after_hlc) {
+        for (const Message& post : client->recent) {
+            if (post.hlc() > resume_after_hlc) {
+                missed.push_back(std::make_shared<const Message>(post));
+            }
+        }
+    } else {
+        // Older than the cache: the newest posts of the following file,
+        // which is in arrival order too
+        auto lines = read_last_lines(data_path(client->username + "_following.txt"), HLC_REPLAY_LIMIT,
+                                     client->following_file_size);
+        for (auto it = lines.rbegin(); it != lines.rend(); ++it) {
+            std::shared_ptr<Message> response = std::make_shared<Message>();
+            if (parse_post(it->second, response.get()) && response->hlc() > resume_after_hlc) {
+                response->set_seq(it->first);
+                missed.push_back(std::move(response));
+            }
+        }
+    }
+    std::stable_sort(missed.begin(), missed.end(),
+                     [](const std::shared_ptr<const Message>& a, const std::shared_ptr<const Message>& b) {
+                         return a->hlc() < b->hlc();
+                     });
+    for (std::shared_ptr<const Message>& post : missed) {
+        connection->push_history(std::move(post));
+    }
+}
+
+Status SNSServiceImpl::List(ServerContext* context, const Request* request, ListReply* list_reply) {
+    latency_stats::ScopedTimer timer(latency_stats::LIST);
+    work_class::Slot slot(work_class::INTERACTIVE);
+    Status status = check_read(request->max_staleness_ms());
+    if (!status.ok()) {
+        return status;
+    }
+    list_reply->set_staleness_ms(staleness_ms());
+    if (route(context, request->username(), &status, [request, list_reply](SNSService::Stub* stub, ClientContext* forward) {
+            return stub->List(forward, *request, list_reply);
+        })) {
+        return status;
+    }
+    if (sharded()) {
+        Client* client;
+        {
+          std::lock_guard<std::mutex> lock(client_db_mutex);
+          client = find_client(request->username());
+        }
+        return client == nullptr ? Status::CANCELLED : list_sharded(client, list_reply);
+    }
+    std::lock_guard<std::mutex> lock(client_db_mutex);
+    Client* client = find_client(request->username()); // find the client object
+
+    if (client == nullptr) {
+        return Status::CANCELLED; // Client not found
+    }
+
+    // Add one page of users to the response. client_db is append-only, so
+    // its size doubles as the registry version and positions as cursors.
+    uint64_t version = client_db.size();
+    uint64_t begin = std::min<uint64_t>(request->cursor(), version);
+    uint64_t end = version;
+    if (request->limit() > 0) {
+        end = std::min<uint64_t>(version, begin + request->limit());
+    }
+    for (uint64_t i = begin; i < end; i++) {
+        list_reply->add_all_users(client_db[i]->username);
+    }
+    list_reply->set_version(version);
+    list_reply->set_next_cursor(end);
+    list_reply->set_has_more(end < version);
+
+    // Add all users the client is following
+    for (Client* followers : client->client_followers) {
+        list_reply->add_followers(followers->username);
+    }
+
+    return Status::OK;
+}
+
+Status SNSServiceImpl::Follow(ServerContext* context, const Request* request, Reply* reply) {
+    latency_stats::ScopedTimer timer(latency_stats::FOLLOW);
+    work_class::Slot slot(work_class::INTERACTIVE);
+    if (standby) {
+        return standby_status();
+    }
+    if (request->arguments_size() == 0) {
+        return Status(grpc::INVALID_ARGUMENT, "No user to follow");
+    }
+    if (sharded()) {
+        FollowOp op;
+        op.set_follower(request->username());
+        op.set_followee(request->arguments(0));
+        return apply_follow(op, context);
+    }
+    std::lock_guard<std::mutex> lock(client_db_mutex);
+    Client* follower = find_client(request->username());
+    Status status = admit_follow_locked(follower);
+    if (!status.ok()) {
+        return status;
+    }
+    return follow_locked(follower, find_client(request->arguments(0)));
+}
+
+Status SNSServiceImpl::UnFollow(ServerContext* context, const Request* request, Reply* reply) {
+    latency_stats::ScopedTimer timer(latency_stats::UNFOLLOW);
+    work_class::Slot slot(work_class::INTERACTIVE);
+    if (standby) {
+        return standby_status();
+    }
+    if (request->arguments_size() == 0) {
+        return Status(grpc::INVALID_ARGUMENT, "No user to unfollow");
+    }
+    if (sharded()) {
+        FollowOp op;
+        op.set_follower(request->username());
+        op.set_followee(request->arguments(0));
+        op.set_unfollow(true);
+        return apply_follow(op, context);
+    }
+    std::lock_guard<std::mutex> lock(client_db_mutex);
+    Client* follower = find_client(request->username());
+    Status status = admit_follow_locked(follower);
+    if (!status.ok()) {
+        return status;
+    }
+    return unfollow_locked(follower, find_client(request->arguments(0)));
+}
+
+// Apply many follow/unfollow operations under a single acquisition of the
+// registry lock and report a status per operation, in request order. A
+// sharded cluster applies them one at a time, since they span shards.
+Status SNSServiceImpl::FollowBatch(ServerContext* context, const FollowBatchRequest* request, FollowBatchReply* batch_reply) {
+    latency_stats::ScopedTimer timer(latency_stats::FOLLOW_BATCH);
+    work_class::Slot slot(work_class::INTERACTIVE);
+    if (standby) {
+        return standby_status();
+    }
+    if (request->ops_size() > MAX_FOLLOW_BATCH) {
+        return Status(grpc::INVALID_ARGUMENT, "At most " + std::to_string(MAX_FOLLOW_BATCH) + " operations per batch");
+    }
+    if (sharded()) {
+        for (const auto& op : request->ops()) {
+            Status status = apply_follow(op, context);
+            auto* result = batch_reply->add_results();
+            result->set_code(status.error_code());
+            result->set_error(status.error_message());
+        }
+        return Status::OK;
+    }
+    std::lock_guard<std::mutex> lock(client_db_mutex);
+    for (const auto& op : request->ops()) {
+        Client* follower = find_client(op.follower());
+        Client* followee = find_client(op.followee());
+        Status status = admit_follow_locked(follower);
+        if (status.ok()) {
+            status = op.unfollow() ? unfollow_locked(follower, followee) : follow_locked(follower, followee);
+        }
+        auto* result = batch_reply->add_results();
+        result->set_code(status.error_code());
+        result->set_error(status.error_message());
+    }
+    return Status::OK;
+}
+
+// RPC Login
+Status SNSServiceImpl::Login(ServerContext* context, const Request* request, Reply* reply) {
+    latency_stats::ScopedTimer timer(latency_stats::LOGIN);
+    work_class::Slot slot(work_class::INTERACTIVE);
+    if (standby) {
+        return standby_status();
+    }
+    Status status;
+    if (route(context, request->username(), &status, [request, reply](SNSService::Stub* stub, ClientContext* forward) {
+            return stub->Login(forward, *request, reply);
+        })) {
+        return status;
+    }
+    std::lock_guard<std::mutex> lock(client_db_mutex);
+    if (find_client(request->username()) != nullptr) { // if user already logged in
+        reply->set_msg("User "+request->username()+" already logged in.");
+        return grpc::Status(grpc::ALREADY_EXISTS,"User "+request->username()+" already logged in");
+    }
+    Client* user;
+    try {
+        user = add_client_locked(request->username());
+    } catch (const std::bad_alloc&) {
+        return Status(grpc::RESOURCE_EXHAUSTED, "No room for more users");
+    }
+    reply->set_msg("Login Success for "+user->username);
+    return Status::OK;
+}
+
+// Register a new user of this server. Caller must hold client_db_mutex.
+Client* SNSServiceImpl::add_client_locked(const std::string& username) {
+    Client* user = client_pool.get(client_pool.create());
+    user->username = username;
+    client_db.push_back(user); // if new user logs in then add to the client database.
+    client_index[user->username] = user;
+    if (replicating()) {
+        Mutation mutation;
+        mutation.set_login(username);
+        replicate(std::move(mutation));
+    }
+    std::size_t users = client_db.size();
+    if (users >= 1024 && (users & (users - 1)) == 0) {
+        log_memory_report(); // every time the user count doubles
+    }
+    return user;
+}
+
+// Latency percentiles of every RPC since the server started, and the
+// counters of this shard's fan-out links
+Status SNSServiceImpl::Stats(ServerContext* context, const Request* request, StatsReply* stats_reply) {
+    for (int m = 0; m < latency_stats::METRIC_COUNT; m++) {
+        latency_stats::Metric metric = static_cast<latency_stats::Metric>(m);
+        latency_stats::Summary summary = latency_stats::summarize(metric);
+        auto* latency = stats_reply->add_latencies();
+        latency->set_name(latency_stats::name(metric));
+        latency->set_count(summary.count);
+        latency->set_p50_ns(summary.p50);
+        latency->set_p99_ns(summary.p99);
+        latency->set_p999_ns(summary.p999);
+        latency->set_max_ns(summary.max);
+    }
+    for (const auto& link : peer_links) {
+        if (link) {
+            link->stats(stats_reply->add_links());
+        }
+    }
+    for (const auto& link : replica_links) {
+        link->stats(stats_reply->add_replicas());
+    }
+    {
+      std::lock_guard<std::mutex> lock(live_mutex);
+      stats_reply->mutable_streams()->set_live(live_connections.size());
+    }
+    stats_reply->mutable_streams()->set_opened(streams_opened);
+    stats_reply->mutable_streams()->set_reaped(streams_reaped);
+    for (int c = 0; c < work_class::CLASS_COUNT; c++) {
+        work_class::Class cls = static_cast<work_class::Class>(c);
+        work_class::Summary summary = work_class::summarize(cls);
+        auto* work = stats_reply->add_work_classes();
+        work->set_name(work_class::name(cls));
+        work->set_slots(summary.slots);
+        work->set_active(summary.active);
+        work->set_waiting(summary.waiting);
+        work->set_entered(summary.entered);
+        work->set_waited(summary.waited);
+        work->set_wait_ns(summary.wait_ns);
+    }
+    auto* admission = stats_reply->mutable_admission();
+    admission->set_rate_limited_posts(rate_limited_posts);
+    admission->set_rate_limited_follows(rate_limited_follows);
+    admission->set_shed(shed);
+    admission->set_backlog(backlog());
+    admission->set_storage_write_us(storage_write_ns / 1000);
+    return Status::OK;
+}
+
+Status SNSServiceImpl::GetShardMap(ServerContext* context, const Request* request, csce662::ShardMapReply* map_reply) {
+    if (standby) {
+        return standby_status();
+    }
+    if (sharded()) {
+        for (const std::string& address : shard_map.addresses()) {
+            map_reply->add_shards(address);
+        }
+    }
+    return Status::OK;
+}
+
+Status SNSServiceImpl::Search(ServerContext* context, const Request* request, SearchReply* search_reply) {
+    latency_stats::ScopedTimer timer(latency_stats::SEARCH);
+    work_class::Slot slot(work_class::INTERACTIVE);
+    Status status = check_read(request->max_staleness_ms());
+    if (!status.ok()) {
+        return status;
+    }
+    search_reply->set_staleness_ms(staleness_ms());
+    std::vector<std::string> terms(request->arguments().begin(), request->arguments().end());
+    if (terms.empty()) {
+        return Status(grpc::INVALID_ARGUMENT, "No search terms given");
+    }
+    std::vector<uint32_t> ids = post_index.search(terms);
+
+    // ids are ascending, so walk backwards to return the newest posts first
+    {
+      std::lock_guard<std::mutex> lock(post_db_mutex);
+      for (auto it = ids.rbegin(); it != ids.rend() && search_reply->posts_size() < MAX_SEARCH_RESULTS; ++it) {
+          *search_reply->add_posts() = post_db[*it];
+      }
+    }
+    // Ids follow the order posts were stored, which concurrent posts can
+    // reach in a different order than they were stamped
+    auto* posts = search_reply->mutable_posts();
+    std::stable_sort(posts->begin(), posts->end(), [](const Message& a, const Message& b) { return a.hlc() > b.hlc(); });
+    return Status::OK;
+}
+
+Status SNSServiceImpl::Timeline(ServerContext* context,
+                                ServerReaderWriter<Message, Message>* stream) {
+    if (standby && !read_replica) {
+        return standby_status();
+    }
+
+    Message message;
+   // Read the first message to get the username
+    if (!stream->Read(&message)) {  // when user enter timeline for 1st time
+        return Status::CANCELLED;  // No message received
+    }
+    auto entry_start = std::chrono::steady_clock::now();
+    if (!owns(message.username())) {
+        return proxy_timeline(context, stream, message);
+    }
+
+    Client* client = nullptr;
+    {
+      std::lock_guard<std::mutex> lock(client_db_mutex);
+      client = find_client(message.username()); // find client object
+    }
+    if (client == nullptr) {
+        return Status::CANCELLED;  // Client not found
+    }
+    if (standby) {
+        // a read replica: tell the client how old the history may be
+        context->AddInitialMetadata(STALENESS_KEY, std::to_string(staleness_ms()));
+    }
+    SlabPool<Connection, 64>::Handle connection_handle;
+    try {
+        connection_handle = connection_pool.create(stream, context);
+    } catch (const std::bad_alloc&) {
+        return Status(grpc::RESOURCE_EXHAUSTED, "No room for more Timeline streams");
+    }
+    Connection* connection = connection_pool.get(connection_handle);
+    connection->username = client->username;
+    {
+      // Taken before the client's lock: a stream waiting its turn must not
+      // hold up posts to the user's other streams. Nothing below blocks on
+      // the client: the history is only queued, and the stream's writer
+      // thread sends it once the lock is released, under a HISTORY slot of
+      // its own.
+      work_class::Slot slot(work_class::HISTORY);
+      std::lock_guard<std::mutex> lock(client->mtx);
+      if (client->connections.size() >= MAX_STREAMS_PER_USER) {
+          connection_pool.destroy(connection_handle);
+          return Status(grpc::RESOURCE_EXHAUSTED, "User " + client->username + " already has " +
+                        std::to_string(MAX_STREAMS_PER_USER) + " Timeline streams open");
+      }
+      {
+        std::lock_guard<std::mutex> live_lock(live_mutex);
+        live_connections.insert(connection);
+      }
+      streams_opened++;
+      // Add the stream to the client's so that it receives their posts.
+      // Posts delivered from now on queue behind the history queued here.
+      client->connections.push_back(connection);
+
+      uint64_t resume_after = message.resume_after();
+      if (resume_after > 0 && resume_after <= client->following_file_size) {
+        // Reconnect: send exactly the posts the client missed
+        replay_posts(client, resume_after, connection);
+      } else if (message.resume_after_hlc() > 0) {
+        // Failover from another server: the posts after the last one it saw
+        replay_posts_after_hlc(client, message.resume_after_hlc(), connection);
+      } else {
+        // If it is the first, read the last 20 messages from the user's followers file
+        auto last20 = read_last_lines(data_path(message.username() + "_following.txt"), 20, client->following_file_size);
+        std::vector<std::shared_ptr<const Message>> history;
+        for (const auto& data_line : last20) {
+          std::shared_ptr<Message> response = std::make_shared<Message>();
+          if (parse_post(data_line.second, response.get())) {
+              response->set_seq(data_line.first);
+              history.push_back(std::move(response));
+          }
+        }
+        // Newest first by hlc: posts from other shards can land in the file
+        // after newer local ones
+        std::stable_sort(history.begin(), history.end(),
+                         [](const std::shared_ptr<const Message>& a, const std::shared_ptr<const Message>& b) {
+                             return a->hlc() > b->hlc();
+                         });
+
+        // Send these last 20 messages back through the stream to the user
+        for (std::shared_ptr<const Message>& response : history) {
+          connection->push_history(std::move(response));
+        }
+      }
+    }
+    connection->start_writer();
+    latency_stats::record(latency_stats::TIMELINE_ENTRY, std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - entry_start).count());
+    // Broadcast messages to followers in a loop
+    Status status = Status::OK;
+    while (stream->Read(&message)) {
+        connection->last_active_ns = steady_now_ns();
+        if (standby) {
+            // a read replica delivers replicated posts but takes none
+            status = Status(grpc::FAILED_PRECONDITION, "This server is a read replica; post to the primary");
+            break;
+        }
+        Status admitted = admit_post(client);
+        if (!admitted.ok()) {
+            // Refuse just this post: echo it back with the reason, in line
+            // with the posts the stream is getting, and keep the stream
+            std::shared_ptr<Message> rejection = std::make_shared<Message>();
+            rejection->set_username(message.username());
+            rejection->set_msg(message.msg());
+            *rejection->mutable_timestamp() = message.timestamp();
+            rejection->set_rejected(admitted.error_message());
+            connection->push(std::move(rejection));
+            continue;
+        }
+        if (message.has_trace()) {
+            message.mutable_trace()->set_server_receive_us(now_us());
+        }
+        message.set_hlc(clock.now());  // the server orders posts, not the client's clock
+        // Format the incoming message for file output
+        std::string formatted_timestamp = timestamp_to_string(message.timestamp());
+
+        std::string ffo = format_file_output(message.username(), message.msg(), formatted_timestamp, message.hlc());
+        store_post(message, ffo);
+        // Broadcast the received message to all of the client's followers.
+        // Copy the list so Follow/UnFollow aren't blocked while we write.
+        std::vector<Client*> followers;
+        {
+          std::lock_guard<std::mutex> lock(client_db_mutex);
+          followers = client->client_followers;
+        }
+        {
+          work_class::Slot slot(work_class::FANOUT);
+          latency_stats::ScopedTimer timer(latency_stats::FANOUT);
+          if (message.has_trace()) {
+              message.mutable_trace()->set_fanout_enqueue_us(now_us());
+          }
+          // followers on other shards, by shard, sent as one item per shard
+          std::vector<std::vector<std::string>> remote_followers(peer_links.size());
+          // replicas are told who got the post rather than working it out
+          Mutation mutation;
+          FanoutPost* replicated = mutation.mutable_post();
+          for (Client* follower : followers) {
+              if (follower->remote_shard >= 0) {
+                  remote_followers[follower->remote_shard].push_back(follower->username);
+              } else {
+                  deliver_post(follower, &message, ffo);
+                  if (replicating()) {
+                      replicated->add_followers(follower->username);
+                  }
+              }
+          }
+          for (std::size_t shard = 0; shard < remote_followers.size(); shard++) {
+              if (!remote_followers[shard].empty()) {
+                  peer_links[shard]->enqueue(message, std::move(remote_followers[shard]));
+              }
+          }
+          if (replicating()) {
+              *replicated->mutable_post() = message;
+              replicated->mutable_post()->clear_trace();
+              replicated->mutable_post()->clear_seq();  // each follower's, not the post's
+              replicate(std::move(mutation));
+          }
+        }
+    }
+
+    // If the stream is closed, take it off the client's streams
+    {
+      std::lock_guard<std::mutex> lock(client->mtx);
+      client->connections.erase(std::remove(client->connections.begin(), client->connections.end(), connection),
+                                client->connections.end());
+    }
+    connection->stop_writer();
+    if (connection->overflowed) {
+        status = Status(grpc::RESOURCE_EXHAUSTED, "Stream fell too far behind");
+    }
+    {
+      std::lock_guard<std::mutex> lock(live_mutex);
+      live_connections.erase(connection);
+      if (connection->reaped) {
+          status = Status(grpc::CANCELLED, "Stream closed by the server as stalled or idle");
+      }
+    }
+    connection_pool.destroy(connection_handle);
+
+    return status;
+}
+
+Status SNSPeerImpl::UpdateFollower(ServerContext* context, const FollowOp* op, FollowResult* result) {
+    if (service->standing_by()) {
+        return standby_status();
+    }
+    std::lock_guard<std::mutex> lock(service->client_db_mutex);
+    Client* followee = service->find_client(op->followee());
+    Status status = Status::CANCELLED;  // followee doesn't exist here
+    if (followee != nullptr && followee->remote_shard < 0) {
+        Client* follower = service->remote_client_locked(op->follower(), service->shard_map.ownerOf(op->follower()));
+        status = op->unfollow() ? service->unfollow_locked(follower, followee) : service->follow_locked(follower, followee);
+    }
+    result->set_code(status.error_code());
+    result->set_error(status.error_message());
+    return Status::OK;
+}
+
+// Deliver the posts another shard's PeerLink sends to their followers here
+Status SNSPeerImpl::Fanout(ServerContext* context, ServerReader<FanoutBatch>* reader, Reply* reply) {
+    if (service->standing_by()) {
+        return standby_status();
+    }
+    FanoutBatch batch;
+    std::vector<Client*> followers;
+    while (reader->Read(&batch)) {
+        for (auto& item : *batch.mutable_posts()) {
+            work_class::Slot slot(work_class::FANOUT);
+            Message* post = item.mutable_post();
+            service->clock.update(post->hlc());
+            std::string ffo = format_file_output(post->username(), post->msg(), timestamp_to_string(post->timestamp()), post->hlc());
+            followers.clear();
+            {
+              std::lock_guard<std::mutex> lock(service->client_db_mutex);
+              for (const std::string& name : item.followers()) {
+                  Client* follower = service->find_client(name);
+                  if (follower != nullptr && follower->remote_shard < 0) {
+                      followers.push_back(follower);
+                  }
+              }
+            }
+            for (Client* follower : followers) {
+                service->deliver_post(follower, post, ffo);
+            }
+            if (service->replicating()) {
+                Mutation mutation;
+                FanoutPost* replicated = mutation.mutable_fanin();
+                *replicated->mutable_post() = *post;
+                replicated->mutable_post()->clear_seq();
+                for (Client* follower : followers) {
+                    replicated->add_followers(follower->username);
+                }
+                service->replicate(std::move(mutation));
+            }
+        }
+    }
+    return Status::OK;
+}
+
+Status SNSPeerImpl::LocalUsers(ServerContext* context, const Request* request, ListReply* list_reply) {
+    if (service->standing_by()) {
+        return standby_status();
+    }
+    std::lock_guard<std::mutex> lock(service->client_db_mutex);
+    for (Client* user : service->client_db) {
+        list_reply->add_all_users(user->username);
+    }
+    return Status::OK;
+}
+
+// Replay one mutation exactly as the primary applied it. Users of other
+// shards get stand-in records, as they did on the primary.
+void SNSServiceImpl::apply_mutation(const Mutation& mutation) {
+    switch (mutation.op_case()) {
+    case Mutation::kLogin: {
+        std::lock_guard<std::mutex> lock(client_db_mutex);
+        if (find_client(mutation.login()) == nullptr) {
+            add_client_locked(mutation.login());
+        }
+        break;
+    }
+    case Mutation::kFollow: {
+        const FollowOp& op = mutation.follow();
+        std::lock_guard<std::mutex> lock(client_db_mutex);
+        Client* follower = owns(op.follower()) ? find_client(op.follower())
+                                               : remote_client_locked(op.follower(), shard_map.ownerOf(op.follower()));
+        Client* followee = owns(op.followee()) ? find_client(op.followee())
+                                               : remote_client_locked(op.followee(), shard_map.ownerOf(op.followee()));
+        if (op.unfollow()) {
+            unfollow_locked(follower, followee);
+        } else {
+            follow_locked(follower, followee);
+        }
+        break;
+    }
+    case Mutation::kPost:
+    case Mutation::kFanin: {
+        const FanoutPost& item = mutation.op_case() == Mutation::kPost ? mutation.post() : mutation.fanin();
+        Message post = item.post();
+        clock.update(post.hlc());
+        std::string ffo = format_file_output(post.username(), post.msg(), timestamp_to_string(post.timestamp()), post.hlc());
+        if (mutation.op_case() == Mutation::kPost) {
+            store_post(post, ffo);
+        }
+        std::vector<Client*> followers;
+        {
+          std::lock_guard<std::mutex> lock(client_db_mutex);
+          for (const std::string& name : item.followers()) {
+              Client* follower = find_client(name);
+              if (follower != nullptr && follower->remote_shard < 0) {
+                  followers.push_back(follower);
+              }
+          }
+        }
+        for (Client* follower : followers) {
+            deliver_post(follower, &post, ffo);
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+// Apply the primary's mutations in index order and ack each batch. A
+// mutation already applied was resent after a broken stream and is
+// skipped; a gap means this replica missed mutations (it restarted) and
+// can't follow this primary any more.
+//
+// Nothing done under replication_mutex waits on a client: delivering a
+// post to a reader only queues it on their streams' outboxes, and the ack
+// is written to the primary after the lock is released.
+Status SNSReplicaImpl::Replicate(ServerContext* context, ServerReaderWriter<ReplicaAck, MutationBatch>* stream) {
+    MutationBatch batch;
+    while (stream->Read(&batch)) {
+        ReplicaAck ack;
+        {
+          std::lock_guard<std::mutex> lock(service->replication_mutex);
+          if (!service->standby) {
+              return Status(grpc::FAILED_PRECONDITION, "This server has been promoted");
+          }
+          service->last_replication_ns = steady_now_ns();
+          for (const Mutation& mutation : batch.mutations()) {
+              if (mutation.index() <= service->applied) {
+                  continue;
+              }
+              if (mutation.index() != service->applied + 1) {
+                  return Status(grpc::DATA_LOSS, "Replica has mutations up to " + std::to_string(service->applied) +
+                                                 ", got " + std::to_string(mutation.index()));
+              }
+              service->apply_mutation(mutation);
+              service->applied = mutation.index();
+          }
+          if (batch.caught_up()) {
+              service->fresh_as_of_us = batch.sent_us();
+          }
+          ack.set_applied(service->applied);
+        }
+        if (batch.mutations_size() > 0 && !stream->Write(ack)) {
+            break;
+        }
+    }
+    return Status::OK;
+}
+
+Status SNSReplicaImpl::Promote(ServerContext* context, const Request* request, Reply* reply) {
+    if (!service->standing_by()) {
+        return Status(grpc::FAILED_PRECONDITION, "Not a replica");
+    }
+    service->promote();
+    reply->set_msg("Promoted");
+    return Status::OK;
+}
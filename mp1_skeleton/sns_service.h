@@ -0,0 +1,333 @@
+#ifndef SNS_SERVICE_H
+#define SNS_SERVICE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <grpc++/grpc++.h>
+
+#include "sns.grpc.pb.h"
+#include "hlc.h"
+#include "peer_link.h"
+#include "post_index.h"
+#include "rate_limit.h"
+#include "replica_link.h"
+#include "shard_map.h"
+#include "slab_pool.h"
+
+/*
+ * The SNS service. All of its state (users, follow graph, posts, search
+ * index) lives in the SNSServiceImpl object and its .txt files live in the
+ * data directory it is given, so tsd runs one over TCP while a benchmark
+ * can run a fresh one per workload over an in-process channel.
+ *
+ * Given a shard map with more than one shard, the service is one shard of
+ * a cluster and only keeps the users that hash to it. Calls about another
+ * shard's user are forwarded to that shard (or, if the caller meant them
+ * for this shard, refused with a redirect to the owner), and follow edges
+ * and posts that cross shards go through the shards' SNSPeer services,
+ * posts over one batched fan-out stream (PeerLink) per pair of shards.
+ *
+ * A server can also be a primary, streaming every mutation to a backup and
+ * read replicas (a ReplicaLink each), or stand by as one of those: it
+ * applies the primary's mutations and takes over once promoted. Until then
+ * a backup refuses clients, and a read replica serves List, Search and
+ * Timeline history and reports how stale its answers may be.
+ */
+
+struct Connection;
+
+struct Client {
+  std::string username;
+  bool connected = true;
+  // Shard that owns this user if this record only stands in for a user of
+  // another shard (in a follow list), else -1
+  int remote_shard = -1;
+  // Lines in <username>_following.txt. Every post delivered to this user is
+  // appended there, so a line number is the post's per-user sequence number.
+  uint64_t following_file_size = 0;
+  std::vector<Client*> client_followers;
+  std::vector<Client*> client_following;
+  // Open Timeline streams, one per device, at most MAX_STREAMS_PER_USER
+  std::vector<Connection*> connections;
+  // Rate limits on this user's posts and follow/unfollow operations
+  TokenBucket post_bucket;
+  TokenBucket follow_bucket;
+  // The last RECENT_CACHE_SIZE delivered posts, so a resume usually doesn't read the file
+  std::deque<csce662::Message> recent;
+  // Highest hlc of the posts dropped from recent. recent is in seq order,
+  // and a post from another shard can arrive after newer ones, so only a
+  // resume from at least this hlc can be served from recent alone.
+  uint64_t evicted_hlc = 0;
+  // Guards connections, following_file_size and recent. The sequence
+  // number must match the file order, and every stream must get posts in
+  // that order.
+  std::mutex mtx;
+  bool operator==(const Client& c1) const{
+    return (username == c1.username);
+  }
+};
+
+// A user may have this many Timeline streams open at once (devices)
+#define MAX_STREAMS_PER_USER 8
+// Posts a stream may have waiting before it is closed as too slow
+#define STREAM_OUTBOX_LIMIT 1024
+
+// State of one Timeline stream, taken from connection_pool when the stream
+// opens and returned when it ends, so reconnect storms reuse the same slots.
+//
+// Posts reach the stream through its outbox, drained by a writer thread of
+// its own: fan-out only queues, so one slow device neither holds up the
+// poster nor the user's other devices. The streams of a user share one
+// immutable Message per delivered post.
+struct Connection {
+  grpc::ServerReaderWriter<csce662::Message, csce662::Message>* stream;
+  grpc::ServerContext* context;
+  std::string username;
+  // steady_clock ns of the last message read from or written to the
+  // stream, and of the start of the write in progress (0: none). A write
+  // blocks while the client isn't reading, which is how a dead client
+  // behind a NAT shows up.
+  std::atomic<int64_t> last_active_ns;
+  std::atomic<int64_t> write_since_ns{0};
+  // Cancelled by the reaper; guarded by live_mutex
+  bool reaped = false;
+  // Cancelled because the outbox filled up
+  std::atomic<bool> overflowed{false};
+
+  Connection(grpc::ServerReaderWriter<csce662::Message, csce662::Message>* s, grpc::ServerContext* c);
+
+  // Queue a post for the writer; cancels the stream if the outbox is full
+  void push(std::shared_ptr<const csce662::Message> post);
+  // Queue a post of the history sent when the stream opens, ahead of any
+  // push(). The writer sends the history under a HISTORY slot, and the
+  // history it hasn't sent doesn't count towards STREAM_OUTBOX_LIMIT.
+  void push_history(std::shared_ptr<const csce662::Message> post);
+  void start_writer();
+  // Stop the writer, dropping what it hasn't written. Call once the
+  // stream is off its user's connections, so nothing more is pushed.
+  void stop_writer();
+
+private:
+  void run_writer();
+
+  std::mutex outbox_mutex;
+  std::condition_variable outbox_cv;
+  std::deque<std::shared_ptr<const csce662::Message>> outbox;
+  // Posts of history at the front of outbox, not yet written
+  std::size_t history_queued = 0;
+  bool closing = false;
+  std::thread writer;
+};
+
+class SNSServiceImpl final : public csce662::SNSService::Service {
+public:
+  // Deletes the .txt files a previous server left in data_dir. shards and
+  // shard_index place this server in a sharded cluster.
+  explicit SNSServiceImpl(const std::string& data_dir = ".", const ShardMap& shards = ShardMap(),
+                          std::size_t shard_index = 0);
+  ~SNSServiceImpl();
+
+  grpc::Status List(grpc::ServerContext* context, const csce662::Request* request, csce662::ListReply* list_reply) override;
+  grpc::Status Follow(grpc::ServerContext* context, const csce662::Request* request, csce662::Reply* reply) override;
+  grpc::Status UnFollow(grpc::ServerContext* context, const csce662::Request* request, csce662::Reply* reply) override;
+  grpc::Status FollowBatch(grpc::ServerContext* context, const csce662::FollowBatchRequest* request, csce662::FollowBatchReply* batch_reply) override;
+  grpc::Status Login(grpc::ServerContext* context, const csce662::Request* request, csce662::Reply* reply) override;
+  grpc::Status Stats(grpc::ServerContext* context, const csce662::Request* request, csce662::StatsReply* stats_reply) override;
+  grpc::Status Search(grpc::ServerContext* context, const csce662::Request* request, csce662::SearchReply* search_reply) override;
+  grpc::Status Timeline(grpc::ServerContext* context,
+                        grpc::ServerReaderWriter<csce662::Message, csce662::Message>* stream) override;
+  grpc::Status GetShardMap(grpc::ServerContext* context, const csce662::Request* request, csce662::ShardMapReply* map_reply) override;
+
+  // Log how many bytes each user costs
+  void memory_report();
+
+  // Stream every mutation from now on to the replica at replica_address;
+  // call once per replica. Call before serving: a replica must see every
+  // mutation from the first.
+  void replicate_to(const std::string& replica_address);
+  // Act as a replica: apply replicated mutations and refuse writes until
+  // promote(). A read replica (serve_reads) answers reads meanwhile; a
+  // backup refuses every client call. With promote_after_s > 0, promote
+  // when the primary has been silent that many seconds.
+  void stand_by(int promote_after_s = 0, bool serve_reads = false);
+  void promote();
+  bool standing_by() const { return standby; }
+
+  // Cancel Timeline streams with a write stuck for stall_s seconds or,
+  // if idle_s > 0, with no traffic either way for idle_s seconds, so their
+  // handler threads and records are freed. Either limit may be 0 (off).
+  void start_reaper(int idle_s, int stall_s);
+
+  // Limit every user to posts_per_s posts and follows_per_s follow/unfollow
+  // operations per second, in bursts of up to RATE_BURST_S seconds' worth.
+  // 0 = no limit.
+  void set_rate_limits(double posts_per_s, double follows_per_s);
+  // Refuse posts and follow/unfollow operations with RESOURCE_EXHAUSTED
+  // while more than max_backlog posts and mutations wait on the fan-out and
+  // replication links, or while an append to a user's file takes more than
+  // max_write_ms on average. 0 = no limit. Call both before serving.
+  void set_admission(uint64_t max_backlog, double max_write_ms);
+
+private:
+  friend class SNSPeerImpl;
+  friend class SNSReplicaImpl;
+
+  // Path of a .txt file in the data directory
+  std::string data_path(const std::string& file) const;
+
+  Client* find_client(const std::string& username);
+  Client* add_client_locked(const std::string& username);
+  grpc::Status follow_locked(Client* follower, Client* to_follow);
+  grpc::Status unfollow_locked(Client* follower, Client* to_unfollow);
+  void log_memory_report();
+  void store_post(const csce662::Message& post, const std::string& ffo);
+  void deliver_post(Client* follower, csce662::Message* post, const std::string& ffo);
+  void replay_posts(Client* client, uint64_t resume_after, Connection* connection);
+  void replay_posts_after_hlc(Client* client, uint64_t resume_after_hlc, Connection* connection);
+
+  bool sharded() const { return shard_map.size() > 1; }
+  bool owns(const std::string& username) const { return shard_map.ownerOf(username) == shard_index; }
+  bool replicating() const { return !replica_links.empty(); }
+  void replicate(csce662::Mutation mutation);
+  // Whether a read no staler than max_staleness_ms can be served here
+  grpc::Status check_read(uint32_t max_staleness_ms) const;
+  // How far behind the primary a replica may be; 0 on a primary
+  uint64_t staleness_ms() const;
+  grpc::Status wrong_shard(grpc::ServerContext* context, const std::string& username) const;
+  // If username belongs to another shard, run call(stub, context) against
+  // it, store its result in *status and return true
+  template <typename Call>
+  bool route(grpc::ServerContext* context, const std::string& username, grpc::Status* status, Call call);
+  Client* remote_client_locked(const std::string& username, std::size_t shard);
+  grpc::Status apply_follow(const csce662::FollowOp& op, grpc::ServerContext* context);
+  grpc::Status list_sharded(Client* client, csce662::ListReply* list_reply);
+  grpc::Status proxy_timeline(grpc::ServerContext* context,
+                              grpc::ServerReaderWriter<csce662::Message, csce662::Message>* stream,
+                              const csce662::Message& first);
+
+  void replicate_follow(Client* follower, Client* followee, bool unfollow);
+  // Apply one of the primary's mutations. Caller must hold replication_mutex,
+  // so this must not wait on clients (see Replicate).
+  void apply_mutation(const csce662::Mutation& mutation);
+  void watch_primary(int promote_after_s);
+  void run_reaper(int idle_s, int stall_s);
+  // One sweep of the reaper over live_connections
+  void reap(int idle_s, int stall_s);
+
+  // Whether the server has room for one more write
+  grpc::Status admit();
+  // admit(), then the poster's rate limit
+  grpc::Status admit_post(Client* poster);
+  // admit(), then the follower's rate limit; caller holds client_db_mutex
+  grpc::Status admit_follow_locked(Client* follower);
+  // Posts and mutations waiting on the links
+  uint64_t backlog();
+  // Fold the time since start, one file append, into storage_write_ns
+  void note_storage_write(std::chrono::steady_clock::time_point start);
+
+  std::string data_dir;
+
+  // Client records live in slabs rather than one heap allocation each
+  SlabPool<Client> client_pool;
+  //Vector that stores every client that has been created
+  std::vector<Client*> client_db;
+  // username -> client, so lookups don't have to scan client_db
+  std::unordered_map<std::string, Client*> client_index;
+  // Guards client_db, client_index and the follower/following lists of every client
+  std::mutex client_db_mutex;
+
+  // Every post made this session; a post's id is its position in the vector
+  std::vector<csce662::Message> post_db;
+  std::mutex post_db_mutex;
+  // Inverted index over post_db used by Search
+  PostIndex post_index;
+  // Stamps posts made here; merges the stamps of posts from other shards
+  // and, on a replica, from the primary
+  HybridClock clock;
+
+  SlabPool<Connection, 64> connection_pool;
+  // Open Timeline streams of this server's users, for the reaper
+  std::unordered_set<Connection*> live_connections;
+  std::mutex live_mutex;
+  std::atomic<uint64_t> streams_opened{0};
+  std::atomic<uint64_t> streams_reaped{0};
+
+  // Limits set by set_rate_limits and set_admission
+  double post_rate = 0;
+  double follow_rate = 0;
+  uint64_t max_backlog = 0;
+  double max_write_ms = 0;
+  // Moving average of a file append, in ns
+  std::atomic<int64_t> storage_write_ns{0};
+  std::atomic<uint64_t> rate_limited_posts{0};
+  std::atomic<uint64_t> rate_limited_follows{0};
+  std::atomic<uint64_t> shed{0};
+
+  ShardMap shard_map;
+  std::size_t shard_index;
+  // Per shard (null for this one): its public service, for forwarding, and
+  // its peer service
+  std::vector<std::unique_ptr<csce662::SNSService::Stub>> shard_stubs;
+  std::vector<std::unique_ptr<csce662::SNSPeer::Stub>> peer_stubs;
+  // Per shard (null for this one): fan-out of posts to its users
+  std::vector<std::unique_ptr<PeerLink>> peer_links;
+
+  // Primary: the links to its replicas
+  std::vector<std::unique_ptr<csce662::SNSReplica::Stub>> replica_stubs;
+  std::vector<std::unique_ptr<ReplicaLink>> replica_links;
+  // Replica: set until promoted
+  std::atomic<bool> standby{false};
+  bool read_replica = false;
+  // Wall-clock time (us) the replica's state was last known to be current
+  std::atomic<int64_t> fresh_as_of_us{0};
+  // Guards applied and orders replication against promotion
+  std::mutex replication_mutex;
+  // Index of the last mutation applied
+  uint64_t applied = 0;
+  // steady_clock time the primary was last heard from, in ns
+  std::atomic<int64_t> last_replication_ns{0};
+  // Promotes the backup when the primary goes silent
+  std::thread watchdog;
+  std::thread reaper;
+  // Wake the background threads when the service is destroyed
+  std::mutex stop_mutex;
+  std::condition_variable stop_cv;
+  bool stopping = false;
+};
+
+// The SNSPeer service of a shard, working on the state of its SNSServiceImpl
+class SNSPeerImpl final : public csce662::SNSPeer::Service {
+public:
+  explicit SNSPeerImpl(SNSServiceImpl* s) : service(s) {}
+
+  grpc::Status UpdateFollower(grpc::ServerContext* context, const csce662::FollowOp* op, csce662::FollowResult* result) override;
+  grpc::Status Fanout(grpc::ServerContext* context, grpc::ServerReader<csce662::FanoutBatch>* reader, csce662::Reply* reply) override;
+  grpc::Status LocalUsers(grpc::ServerContext* context, const csce662::Request* request, csce662::ListReply* list_reply) override;
+
+private:
+  SNSServiceImpl* service;
+};
+
+// The SNSReplica service of a backup, applying mutations to its SNSServiceImpl
+class SNSReplicaImpl final : public csce662::SNSReplica::Service {
+public:
+  explicit SNSReplicaImpl(SNSServiceImpl* s) : service(s) {}
+
+  grpc::Status Replicate(grpc::ServerContext* context,
+                         grpc::ServerReaderWriter<csce662::ReplicaAck, csce662::MutationBatch>* stream) override;
+  grpc::Status Promote(grpc::ServerContext* context, const csce662::Request* request, csce662::Reply* reply) override;
+
+private:
+  SNSServiceImpl* service;
+};
+
+#endif
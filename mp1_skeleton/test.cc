@@ -0,0 +1,297 @@
+/*
+ * Correctness checks for the server's building blocks.
+ *
+ * Build and run with `make test`, or run `./sns_test [filter]` to run only
+ * the checks whose name contains `filter`. Prints one line per check and
+ * exits non-zero if any failed.
+ */
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "hlc.h"
+#include "post_index.h"
+#include "rate_limit.h"
+#include "shard_map.h"
+#include "slab_pool.h"
+
+// Failures of the check being run
+static int failures = 0;
+
+#define CHECK(cond, what) do { if (!(cond)) { failures++; std::cout << "  FAILED: " << what << std::endl; } } while (0)
+
+// PostIndex::search against a scan of every post, on random posts over a
+// small vocabulary so posting lists run to many blocks. Id gaps vary from 1
+// to millions, so deltas take one to four varint bytes.
+static void testPostIndex()
+{
+    const int kPosts = 5000;
+    const std::vector<std::string> vocabulary = {"alpha", "beta", "gamma", "delta", "eps", "zeta", "eta", "theta"};
+    std::mt19937 rng(662);
+    std::uniform_int_distribution<int> word(0, vocabulary.size() - 1);
+    std::uniform_int_distribution<int> length(1, 4);
+    std::uniform_int_distribution<int> gap_bits(0, 22);
+
+    PostIndex index;
+    std::vector<uint32_t> ids;
+    std::vector<std::set<std::string>> terms;
+    uint32_t id = 0;
+    for (int i = 0; i < kPosts; i++) {
+        id += 1 + (rng() & ((1u << gap_bits(rng)) - 1)) / 64;
+        std::string text;
+        std::set<std::string> post_terms;
+        for (int w = length(rng); w > 0; w--) {
+            const std::string& term = vocabulary[word(rng)];
+            text += (w % 2 ? " " : ", ") + (i % 3 ? term : std::string(1, std::toupper(term[0])) + term.substr(1));
+            post_terms.insert(term);
+        }
+        index.add(id, text);
+        ids.push_back(id);
+        terms.push_back(post_terms);
+    }
+
+    auto scan = [&](const std::vector<std::string>& query) {
+        std::vector<uint32_t> matches;
+        for (std::size_t i = 0; i < ids.size(); i++) {
+            bool all = true;
+            for (const std::string& term : query) {
+                all = all && terms[i].count(term) > 0;
+            }
+            if (all) {
+                matches.push_back(ids[i]);
+            }
+        }
+        return matches;
+    };
+
+    for (int q = 0; q < 500; q++) {
+        std::vector<std::string> query;
+        for (int t = 1 + q % 3; t > 0; t--) {
+            query.push_back(vocabulary[word(rng)]);
+        }
+        std::vector<uint32_t> expected = scan(query);
+        std::vector<uint32_t> got = index.search(query);
+        std::ostringstream what;
+        what << "query " << q << ": " << got.size() << " results, expected " << expected.size();
+        CHECK(got == expected, what.str());
+    }
+    CHECK(index.search({"missing"}).empty(), "unknown term matches nothing");
+    CHECK(index.search({"alpha", "missing"}).empty(), "unknown term empties the intersection");
+
+    // Lists that end exactly at, and one past, a block boundary, and a term
+    // found only in the last id of each block
+    PostIndex edges;
+    for (uint32_t i = 0; i < 3 * 128 + 1; i++) {
+        std::string text = "all";
+        if (i < 128) {
+            text += " full";
+        }
+        if (i < 129) {
+            text += " over";
+        }
+        if (i % 128 == 127) {
+            text += " last";
+        }
+        edges.add(i * 1000, text);
+    }
+    CHECK(edges.search({"full"}).size() == 128, "list of exactly one block");
+    CHECK(edges.search({"over"}).size() == 129, "list one past a block");
+    CHECK(edges.search({"over", "all"}).size() == 129, "block-boundary list intersected with a longer one");
+    std::vector<uint32_t> last = edges.search({"all", "last"});
+    CHECK(last == std::vector<uint32_t>({127000, 255000, 383000}), "last id of every block");
+    CHECK(edges.search({"full", "last"}) == std::vector<uint32_t>({127000}), "galloping to a block's last id");
+}
+
+// Objects of a SlabPool, counting live instances
+struct Counted {
+    static int live;
+    int value;
+    explicit Counted(int v) : value(v) { live++; }
+    ~Counted() { live--; }
+};
+int Counted::live = 0;
+
+// Create, destroy and reuse slots, across more slabs than one table chunk
+static void testSlabPool()
+{
+    {
+        SlabPool<Counted, 4> pool;
+        const int kObjects = 4 * SlabPool<Counted, 4>::TABLE_CHUNK + 100;
+        std::vector<SlabPool<Counted, 4>::Handle> handles;
+        std::vector<Counted*> pointers;
+        for (int i = 0; i < kObjects; i++) {
+            handles.push_back(pool.create(i));
+            pointers.push_back(pool.get(handles.back()));
+        }
+        CHECK(pool.size() == (std::size_t)kObjects && Counted::live == kObjects, "every object is live");
+        bool intact = true;
+        for (int i = 0; i < kObjects; i++) {
+            intact = intact && pool.get(handles[i]) == pointers[i] && pointers[i]->value == i;
+        }
+        CHECK(intact, "objects keep their address and value as the pool grows");
+
+        pool.destroy(handles[10]);
+        pool.destroy(handles[20]);
+        CHECK(Counted::live == kObjects - 2, "destroy runs the destructor");
+        CHECK(pool.create(-1) == handles[20], "the last freed slot is reused first");
+        CHECK(pool.create(-2) == handles[10], "then the one before");
+        CHECK(pool.get(handles[10])->value == -2, "a reused slot holds the new object");
+        CHECK(pool.create(-3) == (SlabPool<Counted, 4>::Handle)kObjects, "then unused slots");
+        bool threw = false;
+        pool.destroy(handles[30]);
+        try {
+            pool.destroy(handles[30]);
+        } catch (const std::logic_error&) {
+            threw = true;
+        }
+        CHECK(threw, "destroying a free slot throws");
+    }
+    CHECK(Counted::live == 0, "the pool destroys what is left when it goes");
+}
+
+// Adding a shard only moves users to the new shard, and about 1/n of them
+static void testShardMap()
+{
+    ShardMap three({"a:1", "b:2", "c:3"});
+    ShardMap four({"a:1", "b:2", "c:3", "d:4"});
+    ShardMap three_again({"a:1", "b:2", "c:3"});
+    const int kUsers = 20000;
+    int moved = 0;
+    std::vector<int> per_shard(3);
+    for (int u = 0; u < kUsers; u++) {
+        std::string user = "user" + std::to_string(u);
+        std::size_t before = three.ownerOf(user);
+        std::size_t after = four.ownerOf(user);
+        per_shard[before]++;
+        if (before != after) {
+            moved++;
+            if (after != 3) {
+                CHECK(false, user << " moved from shard " << before << " to old shard " << after);
+                break;
+            }
+        }
+        if (three_again.ownerOf(user) != before) {
+            CHECK(false, user << " has a different owner in an identical map");
+            break;
+        }
+    }
+    CHECK(moved > kUsers / 8 && moved < kUsers * 3 / 8, moved << " of " << kUsers << " users moved, expected about 1/4");
+    for (int count : per_shard) {
+        CHECK(count > kUsers / 5, "shard with only " << count << " of " << kUsers << " users");
+    }
+    CHECK(ShardMap().ownerOf("anyone") == 0, "empty map owns everyone at 0");
+    CHECK(ShardMap({"only:1"}).ownerOf("anyone") == 0, "single shard owns everyone");
+}
+
+// Stamps only go up, never repeat (even across threads), and jump past a
+// merged remote stamp
+static void testHybridClock()
+{
+    HybridClock clock;
+    uint64_t prev = clock.now();
+    for (int i = 0; i < 100000; i++) {
+        uint64_t next = clock.now();
+        if (next <= prev) {
+            CHECK(false, "now() went from " << prev << " to " << next);
+            break;
+        }
+        prev = next;
+    }
+
+    uint64_t wall_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    CHECK(HybridClock::physicalMs(clock.now()) + 1000 > wall_ms, "physical part follows the wall clock");
+
+    // a stamp from a server whose clock runs a minute ahead
+    uint64_t remote = ((wall_ms + 60000) << HybridClock::LOGICAL_BITS) + 5;
+    clock.update(remote);
+    uint64_t after = clock.now();
+    CHECK(after > remote, "now() after update() orders after the remote stamp");
+    CHECK(HybridClock::physicalMs(after) == wall_ms + 60000 && HybridClock::logical(after) == 6,
+          "merged stamp keeps the remote time and advances its counter");
+    clock.update(remote - 100);
+    CHECK(clock.now() > after, "an older remote stamp doesn't move the clock back");
+
+    HybridClock shared;
+    const int kThreads = 4;
+    const int kStamps = 20000;
+    std::vector<std::vector<uint64_t>> stamps(kThreads);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; t++) {
+        threads.emplace_back([&shared, &stamps, t]() {
+            for (int i = 0; i < kStamps; i++) {
+                stamps[t].push_back(shared.now());
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    std::set<uint64_t> unique;
+    for (const std::vector<uint64_t>& s : stamps) {
+        CHECK(std::is_sorted(s.begin(), s.end()), "one thread's stamps go up");
+        unique.insert(s.begin(), s.end());
+    }
+    CHECK(unique.size() == (std::size_t)kThreads * kStamps, "no stamp is handed out twice");
+}
+
+// A bucket starts full, holds at most burst tokens and refills at rate.
+// Time is passed in, so the checks don't depend on how the machine runs.
+static void testTokenBucket()
+{
+    typedef std::chrono::steady_clock::time_point Time;
+    typedef std::chrono::milliseconds ms;
+    Time t0 = std::chrono::steady_clock::now();
+    TokenBucket bucket;
+    int taken = 0;
+    while (taken < 100 && bucket.take(10, 5, t0)) {
+        taken++;
+    }
+    CHECK(taken == 5, "a new bucket gives its burst of 5, gave " << taken);
+    CHECK(bucket.take(10, 5, t0 + ms(120)), "refilled one token after 120ms at 10/s");
+    CHECK(!bucket.take(10, 5, t0 + ms(120)), "but not two");
+    CHECK(!bucket.take(10, 5, t0 + ms(170)), "fractions of a token add up: 0.7 after 170ms");
+    CHECK(bucket.take(10, 5, t0 + ms(230)), "and make a token by 230ms");
+
+    TokenBucket capped;
+    capped.take(1000, 3, t0);
+    taken = 0;
+    while (taken < 100 && capped.take(1000, 3, t0 + std::chrono::hours(1))) {
+        taken++;
+    }
+    CHECK(taken == 3, "refill stops at the burst of 3, gave " << taken);
+}
+
+int main(int argc, char** argv)
+{
+    std::string filter = argc > 1 ? argv[1] : "";
+    const std::vector<std::pair<std::string, std::function<void()>>> checks = {
+        {"PostIndex", testPostIndex},
+        {"SlabPool", testSlabPool},
+        {"ShardMap", testShardMap},
+        {"HybridClock", testHybridClock},
+        {"TokenBucket", testTokenBucket},
+    };
+    int failed = 0;
+    for (const auto& check : checks) {
+        if (check.first.find(filter) == std::string::npos) {
+            continue;
+        }
+        failures = 0;
+        check.second();
+        std::cout << (failures ? "FAIL " : "ok   ") << check.first << std::endl;
+        failed += failures > 0;
+    }
+    return failed > 0 ? 1 : 0;
+}
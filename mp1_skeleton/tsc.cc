@@ -1,14 +1,26 @@
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <fstream>
+#include <future>
+#include <iomanip>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <random>
 #include <thread>
 #include <vector>
 #include <string>
 #include <unistd.h>
 #include <csignal>
+#include <google/protobuf/arena.h>
 #include <grpc++/grpc++.h>
 #include "client.h"
+#include "sns_client.h"
 
 #include "sns.grpc.pb.h"
+using google::protobuf::Arena;
+using google::protobuf::ArenaOptions;
 using grpc::Channel;
 using grpc::ClientContext;
 using grpc::ClientReader;
@@ -19,6 +31,8 @@ using csce662::Message;
 using csce662::ListReply;
 using csce662::Request;
 using csce662::Reply;
+using csce662::SearchReply;
+using csce662::StatsReply;
 using csce662::SNSService;
 
 void sig_ignore(int sig) {
@@ -33,25 +47,104 @@ std::string trim(const std::string& str) {
   return str.substr(start, end - start + 1);
 }
 
-Message MakeMessage(const std::string& username, const std::string& msg) {
-    Message m;
-    m.set_username(username);
-    m.set_msg(msg);
-    google::protobuf::Timestamp* timestamp = new google::protobuf::Timestamp();
+#define LIST_PAGE_SIZE 1000
+
+// Default number of batch-mode RPCs in flight at once
+#define BATCH_IN_FLIGHT 32
+
+// Reconnect backoff: the n-th retry waits a random time in
+// [0, min(RECONNECT_MAX_MS, RECONNECT_BASE_MS * 2^n)), so clients dropped by
+// the same server restart don't all come back at the same moment
+#define RECONNECT_BASE_MS 500
+#define RECONNECT_MAX_MS 30000
+#define RECONNECT_LOGIN_TIMEOUT_S 5
+
+// LIST and SEARCH go to the primary when the read replica is further
+// behind it than this
+#define READ_MAX_STALENESS_MS 5000
+
+// Posts are built on an Arena that the caller Resets once the post is sent.
+// Its first block is a buffer owned by the caller, so the only malloc left
+// per post is for message text too long for the small string buffer.
+#define ARENA_BLOCK_SIZE 4096
+
+Message* MakeMessage(Arena* arena, const std::string& username, const std::string& msg) {
+    Message* m = Arena::CreateMessage<Message>(arena);
+    m->set_username(username);
+    m->set_msg(msg);
+    google::protobuf::Timestamp* timestamp = m->mutable_timestamp();
     timestamp->set_seconds(time(NULL));
     timestamp->set_nanos(0);
-    m.set_allocated_timestamp(timestamp);
     return m;
 }
 
 
+// Wall-clock time in microseconds, as used by the trace fields of Message
+int64_t now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Collects the per-hop latencies of traced posts received in the timeline
+// and prints their distribution every TRACE_REPORT_EVERY posts
+#define TRACE_REPORT_EVERY 100
+
+class TraceStats
+{
+public:
+  void add(const csce662::Trace& trace, int64_t display_us) {
+    if (trace.client_send_us() == 0 || trace.server_write_us() == 0) {
+      return; // not a live, fully traced delivery
+    }
+    samples[0].push_back(trace.server_receive_us() - trace.client_send_us());
+    samples[1].push_back(trace.fanout_enqueue_us() - trace.server_receive_us());
+    samples[2].push_back(trace.server_write_us() - trace.fanout_enqueue_us());
+    samples[3].push_back(display_us - trace.server_write_us());
+    samples[4].push_back(display_us - trace.client_send_us());
+    if (samples[4].size() >= TRACE_REPORT_EVERY) {
+      report();
+    }
+  }
+
+private:
+  void report() {
+    std::cout << "[trace] " << samples[4].size() << " posts, latency in ms (p50 / p99 / max):" << std::endl;
+    std::cout << std::fixed << std::setprecision(3);
+    for (int hop = 0; hop < HOPS; hop++) {
+      std::vector<int64_t>& v = samples[hop];
+      std::sort(v.begin(), v.end());
+      std::cout << "  " << std::left << std::setw(16) << names[hop] << std::right
+                << v[v.size() / 2] / 1000.0 << " / "
+                << v[std::min(v.size() - 1, v.size() * 99 / 100)] / 1000.0 << " / "
+                << v.back() / 1000.0 << std::endl;
+      v.clear();
+    }
+    std::cout.unsetf(std::ios::floatfield);
+  }
+
+  static const int HOPS = 5;
+  const char* const names[HOPS] = {
+    "client->server", "server->fanout", "fanout->write", "write->display", "total",
+  };
+  std::vector<int64_t> samples[HOPS];
+};
+
 class Client : public IClient
 {
 public:
   Client(const std::string& hname,
 	 const std::string& uname,
-	 const std::string& p)
-    :hostname(hname), username(uname), port(p) {}
+	 const std::string& p,
+	 bool t = false,
+	 const std::string& failover = "",
+	 const std::string& read_replica = "")
+    :hostname(hname), username(uname), port(p), trace(t), failover_address(failover),
+     read_address(read_replica) {}
+
+  // Run FOLLOW/UNFOLLOW/LIST commands from script with up to max_in_flight
+  // RPCs outstanding, printing each result in script order. Returns the
+  // process exit status: 0 if every command succeeded.
+  int runBatch(std::istream& script, int max_in_flight);
 
   
 protected:
@@ -63,16 +156,50 @@ private:
   std::string hostname;
   std::string username;
   std::string port;
+  // Attach a Trace to every post and report per-hop delivery latency
+  bool trace;
+  TraceStats trace_stats;
+  // host:port of a backup server; reconnects alternate between it and the
+  // primary, so the client follows a failover
+  std::string failover_address;
+  // host:port of a read replica that serves LIST and SEARCH, if any
+  std::string read_address;
+  std::unique_ptr<SNSClient> read_client;
   
-  // You can have an instance of the client stub
-  // as a member variable.
-  std::unique_ptr<SNSService::Stub> stub_;
+  // Async client for the unary calls; its stub carries the rest
+  std::unique_ptr<SNSClient> sns_client;
+
+  // Users seen by earlier LIST calls and the registry version they cover,
+  // so a repeat LIST only fetches users registered since
+  std::vector<std::string> known_users;
+  uint64_t users_version = 0;
+
+  // Timeline stream, shared by the reader thread and the post loop
+  std::mutex timeline_mtx;
+  // Serializes writes to timeline_stream. Taken after timeline_mtx, which
+  // a write doesn't hold, so reconnect() can cancel a write that blocks.
+  std::mutex write_mtx;
+  std::unique_ptr<ClientContext> timeline_context;
+  std::shared_ptr<ClientReaderWriter<Message, Message>> timeline_stream;
+  // Posts typed while the stream was down, sent once it is back
+  std::vector<Message> pending_posts;
+  // seq of the last post received, where a reconnect resumes from
+  uint64_t last_seq = 0;
+  // Newest hlc received; seqs are per server, so a reconnect to a
+  // different server (a failover) resumes from this instead
+  uint64_t last_hlc = 0;
+  // Server the Timeline stream was last opened on
+  std::string timeline_address;
   
   IReply Login();
   IReply List();
   IReply Follow(const std::string &username);
   IReply UnFollow(const std::string &username);
+  IReply Search(const std::vector<std::string> &terms);
+  IReply Stats();
   void   Timeline(const std::string &username);
+  bool   openTimeline();
+  void   reconnect();
 };
 
 
@@ -83,7 +210,13 @@ int Client::connectTo()
 {
   
   std::string server_address = hostname + ":" + port;
-  stub_ = SNSService::NewStub(grpc::CreateChannel(server_address, grpc::InsecureChannelCredentials())); // create a stub to interact with server
+  sns_client.reset(new SNSClient(grpc::CreateChannel(server_address, grpc::InsecureChannelCredentials()), username)); // create a client to interact with server
+  // Against a sharded cluster, talk straight to the shard that owns us
+  sns_client->enableRouting();
+  if (!read_address.empty()) {
+    read_client.reset(new SNSClient(grpc::CreateChannel(read_address, grpc::InsecureChannelCredentials()), username));
+    read_client->setMaxStaleness(READ_MAX_STALENESS_MS);
+  }
   
   // Check if the connection is successful by attempting to log in
   IReply reply = Login();
@@ -142,6 +275,26 @@ IReply Client::processCommand(std::string& input)
             return ire;
         }
         ire = List();
+    } else if (command == "SEARCH") {
+        std::vector<std::string> terms;
+        std::string term;
+        while (iss >> term) {
+            terms.push_back(term);
+        }
+        if (!terms.empty()) {
+            ire = Search(terms);
+        } else {
+            std::cerr << "No search terms specified." << std::endl;
+            ire.comm_status = FAILURE_INVALID;
+        }
+    } else if (command == "STATS") {
+        iss >> ignore;
+        if(iss)
+        {
+            ire.comm_status = FAILURE_INVALID;
+            return ire;
+        }
+        ire = Stats();
     } else if (command == "TIMELINE") {
         iss >> ignore;
         if(iss)
@@ -168,23 +321,62 @@ void Client::processTimeline()
 // List Command
 IReply Client::List() {
     IReply ire;
-    Request request;
-    request.set_username(username);  // set the username
-
-    ClientContext context;
-
-    ListReply server_reply;
-    grpc::Status status = stub_->List(&context, request, &server_reply); // call list fun in tsd.cc (server)
+    uint64_t cursor = users_version;  // only users registered since the last LIST
+
+    grpc::Status status;
+    bool first_page = true;
+    bool use_replica = read_client != nullptr;
+    while (true) {
+        RpcResult<ListReply> result;
+        bool from_replica = false;
+        if (use_replica) {
+            result = read_client->list(cursor, LIST_PAGE_SIZE).get();  // replicas share the registry order, so cursors carry over
+            from_replica = result.status.ok();
+        }
+        if (!from_replica) {
+            result = sns_client->list(cursor, LIST_PAGE_SIZE).get(); // call list fun in tsd.cc (server)
+        }
+        status = result.status;
+        if (!status.ok()) {
+            break;
+        }
+        const ListReply& server_reply = result.reply;
+        if (from_replica && server_reply.version() < users_version) {
+            // the replica hasn't caught up with what we already have: keep
+            // our copy and ask the primary instead
+            use_replica = false;
+            continue;
+        }
+        if (server_reply.version() < users_version) {
+            // the server's registry is older than our copy (it restarted), start over
+            known_users.clear();
+            users_version = 0;
+            cursor = 0;
+            continue;
+        }
+        if (first_page) {
+            if (cursor == 0) {
+                known_users.clear();  // a full list (a sharded server sends one every time)
+            }
+            for (const auto& follower : server_reply.followers()) {
+                ire.followers.push_back(follower);
+            }
+            first_page = false;
+        }
+        for (const auto& user : server_reply.all_users()) {
+            known_users.push_back(user);
+        }
+        users_version = server_reply.next_cursor();
+        if (!server_reply.has_more()) {
+            break;
+        }
+        cursor = server_reply.next_cursor();
+    }
 
     ire.grpc_status = status;
     if (status.ok()) { // if success
         ire.comm_status = SUCCESS;
-        for (const auto& user : server_reply.all_users()) {
-            ire.all_users.push_back(user);
-        }
-        for (const auto& follower : server_reply.followers()) {
-            ire.followers.push_back(follower);
-        }
+        ire.all_users = known_users;
     } else {
         ire.comm_status = FAILURE_UNKNOWN; // failed
         std::cerr << "Failed to list users: " << status.error_message() << std::endl;
@@ -196,15 +388,8 @@ IReply Client::List() {
 // Follow Command        
 IReply Client::Follow(const std::string& username2) {
     IReply ire; 
-      
-    Request request;
-    request.set_username(username); // current user
-    request.add_arguments(username2);  // The username to follow
 
-    ClientContext context;
-
-    Reply server_reply;
-    grpc::Status status = stub_->Follow(&context, request, &server_reply); // call follow function in tsd.cc
+    grpc::Status status = sns_client->follow(username2).get().status; // call follow function in tsd.cc
     
     ire.grpc_status = status;
     if (status.ok()) {   // success
@@ -216,6 +401,11 @@ IReply Client::Follow(const std::string& username2) {
         ire.grpc_status = Status::OK;
         ire.comm_status = FAILURE_ALREADY_EXISTS; 
     }
+    else if(status.error_code() == grpc::RESOURCE_EXHAUSTED) // over the rate limit, or the server is overloaded
+    {
+        ire.comm_status = FAILURE_UNKNOWN;
+        std::cerr << "Failed to follow: " << status.error_message() << std::endl;
+    }
     else {
         ire.grpc_status = Status::OK;  // if follower doesnt exist
         ire.comm_status = FAILURE_INVALID_USERNAME;
@@ -228,14 +418,7 @@ IReply Client::Follow(const std::string& username2) {
 IReply Client::UnFollow(const std::string& username2) {
     IReply ire;
 
-    Request request;
-    request.set_username(username); // current user
-    request.add_arguments(username2);  // The username to unfollow
-
-    ClientContext context;
-
-    Reply server_reply;
-    grpc::Status status = stub_->UnFollow(&context, request, &server_reply); // call unfollow fun in tsd.cc(server)
+    grpc::Status status = sns_client->unfollow(username2).get().status; // call unfollow fun in tsd.cc(server)
 
     ire.grpc_status = status;
     if (status.ok()) {
@@ -247,6 +430,11 @@ IReply Client::UnFollow(const std::string& username2) {
         ire.grpc_status = Status::OK;
         ire.comm_status = FAILURE_ALREADY_EXISTS; 
     }
+    else if(status.error_code() == grpc::RESOURCE_EXHAUSTED)
+    {
+        ire.comm_status = FAILURE_UNKNOWN;
+        std::cerr << "Failed to unfollow: " << status.error_message() << std::endl;
+    }
     else {
         ire.grpc_status = Status::OK;
         ire.comm_status = FAILURE_INVALID_USERNAME; // if the username to unfollow doesn't exist
@@ -256,19 +444,133 @@ IReply Client::UnFollow(const std::string& username2) {
     return ire;
 }
 
-// Login Command  
-IReply Client::Login() {
+// Search Command
+IReply Client::Search(const std::vector<std::string>& terms) {
+    IReply ire;
+
+    Request request;
+    request.set_username(username);
+    for (const auto& term : terms) {
+        request.add_arguments(term);  // every term must appear in a post
+    }
+
+    SearchReply server_reply;
+    grpc::Status status = grpc::Status(grpc::UNAVAILABLE, "no read replica");
+    if (read_client) {
+        ClientContext context;
+        request.set_max_staleness_ms(READ_MAX_STALENESS_MS);
+        status = read_client->stub()->Search(&context, request, &server_reply);
+    }
+    if (!status.ok()) {
+        ClientContext context;
+        server_reply.Clear();
+        status = sns_client->stub()->Search(&context, request, &server_reply); // call search fun in tsd.cc(server)
+    }
+
+    ire.grpc_status = status;
+    if (status.ok()) {
+        ire.comm_status = SUCCESS;
+        std::cout << server_reply.posts_size() << " matching posts";
+        if (server_reply.staleness_ms() > 0) {
+            std::cout << " (from a replica up to " << server_reply.staleness_ms() << "ms behind)";
+        }
+        std::cout << std::endl;
+        for (const auto& post : server_reply.posts()) {
+            std::time_t timestamp = post.timestamp().seconds();
+            displayPostMessage(post.username(), post.msg(), timestamp);
+        }
+    } else {
+        ire.comm_status = FAILURE_UNKNOWN;
+        std::cerr << "Failed to search posts: " << status.error_message() << std::endl;
+    }
+
+    return ire;
+}
 
+// Stats Command
+IReply Client::Stats() {
     IReply ire;
-  
+
     Request request;
-    request.set_username(username);  // Set the username
+    request.set_username(username);
 
     ClientContext context;
-    
+
+    StatsReply server_reply;
+    grpc::Status status = sns_client->stub()->Stats(&context, request, &server_reply); // call stats fun in tsd.cc(server)
+
+    ire.grpc_status = status;
+    if (status.ok()) {
+        ire.comm_status = SUCCESS;
+        // latencies are reported in microseconds
+        std::cout << std::left << std::setw(16) << "RPC" << std::right << std::setw(10) << "count"
+                  << std::setw(12) << "p50(us)" << std::setw(12) << "p99(us)"
+                  << std::setw(12) << "p999(us)" << std::setw(12) << "max(us)" << std::endl;
+        std::cout << std::fixed << std::setprecision(1);
+        for (const auto& latency : server_reply.latencies()) {
+            std::cout << std::left << std::setw(16) << latency.name() << std::right
+                      << std::setw(10) << latency.count()
+                      << std::setw(12) << latency.p50_ns() / 1000.0
+                      << std::setw(12) << latency.p99_ns() / 1000.0
+                      << std::setw(12) << latency.p999_ns() / 1000.0
+                      << std::setw(12) << latency.max_ns() / 1000.0 << std::endl;
+        }
+        if (server_reply.links_size() > 0) {
+            // fan-out links of a sharded server, averaged over their lifetime
+            std::cout << std::left << std::setw(22) << "Link to" << std::right << std::setw(10) << "posts"
+                      << std::setw(10) << "batches" << std::setw(12) << "posts/s" << std::setw(12) << "queue"
+                      << std::setw(12) << "max queue" << std::setw(10) << "dropped" << std::endl;
+            for (const auto& link : server_reply.links()) {
+                std::cout << std::left << std::setw(22) << link.peer() << std::right
+                          << std::setw(10) << link.posts() << std::setw(10) << link.batches()
+                          << std::setw(12) << (link.seconds() > 0 ? link.posts() / link.seconds() : 0.0)
+                          << std::setw(12) << link.queue_depth() << std::setw(12) << link.max_queue_depth()
+                          << std::setw(10) << link.dropped() << std::endl;
+            }
+        }
+        std::cout << "Timeline streams: " << server_reply.streams().live() << " live, "
+                  << server_reply.streams().opened() << " opened, "
+                  << server_reply.streams().reaped() << " reaped" << std::endl;
+        const auto& admission = server_reply.admission();
+        std::cout << "Admission: " << admission.rate_limited_posts() << " posts and "
+                  << admission.rate_limited_follows() << " follows rate limited, " << admission.shed()
+                  << " shed; " << admission.backlog() << " queued, file append "
+                  << admission.storage_write_us() << " us avg" << std::endl;
+        // priority classes: slots, load now, and how often and long they waited
+        std::cout << std::left << std::setw(14) << "Work class" << std::right << std::setw(8) << "slots"
+                  << std::setw(8) << "active" << std::setw(10) << "waiting" << std::setw(12) << "entered"
+                  << std::setw(10) << "waited" << std::setw(14) << "avg wait(us)" << std::endl;
+        for (const auto& work : server_reply.work_classes()) {
+            std::cout << std::left << std::setw(14) << work.name() << std::right << std::setw(8) << work.slots()
+                      << std::setw(8) << work.active() << std::setw(10) << work.waiting()
+                      << std::setw(12) << work.entered() << std::setw(10) << work.waited()
+                      << std::setw(14) << (work.waited() > 0 ? work.wait_ns() / 1000.0 / work.waited() : 0.0)
+                      << std::endl;
+        }
+        for (const auto& replica : server_reply.replicas()) {
+            std::cout << "Replicating to " << replica.address() << (replica.in_sync() ? "" : " (OUT OF SYNC)")
+                      << ": " << replica.mutations() << " mutations in " << replica.batches() << " batches, "
+                      << replica.queue_depth() << " queued (max " << replica.max_queue_depth() << "), "
+                      << replica.unacked() << " unacked" << std::endl;
+        }
+        std::cout.unsetf(std::ios::floatfield);
+    } else {
+        ire.comm_status = FAILURE_UNKNOWN;
+        std::cerr << "Failed to get stats: " << status.error_message() << std::endl;
+    }
+
+    return ire;
+}
+
+// Login Command  
+IReply Client::Login() {
+
+    IReply ire;
+
     // Make a gRPC call to the Login RPC
-    Reply server_reply;
-    grpc::Status status = stub_->Login(&context, request, &server_reply); // call login function in tsd.cc(server side)
+    RpcResult<Reply> result = sns_client->login().get(); // call login function in tsd.cc(server side)
+    grpc::Status status = result.status;
+    const Reply& server_reply = result.reply;
     
     ire.grpc_status = status;
     if (status.ok()) {
@@ -307,34 +609,283 @@ void Client::Timeline(const std::string& username) {
     // CTRL-C (SIGINT)
     // ------------------------------------------------------------
   
-    ClientContext context;
-    std::shared_ptr<ClientReaderWriter<Message, Message>> stream(
-        stub_->Timeline(&context));   // bidirectional stream
-
-    Message initial_message;
-    initial_message.set_username(username);
-    stream->Write(initial_message);    // When user enters timeline for the 1st time we just trigger the serve to store the stream correspond to client
+    bool opened;
+    {
+      std::lock_guard<std::mutex> lock(timeline_mtx);
+      timeline_address = hostname + ":" + port;
+      opened = openTimeline();
+    }
+    if (!opened) {
+        std::cout << "Could not open the timeline; reconnecting" << std::endl;
+    }
 
-    // Separate thread to read messages from the server
-    std::thread reader([stream]() { 
-        Message server_message;
-        while (stream->Read(&server_message)) { //  reading messages from server
-            std::time_t timestamp = server_message.timestamp().seconds();
-            displayPostMessage(server_message.username(), server_message.msg(), timestamp); // if msg exist post the msg in timeline
+    // Separate thread to read messages from the server. When the stream
+    // breaks (or never opened) it reconnects and carries on from the last
+    // post it saw.
+    std::thread reader([this, opened]() {
+        for (bool open = opened; ; open = true) {
+            if (open) {
+              std::shared_ptr<ClientReaderWriter<Message, Message>> stream;
+              {
+                std::lock_guard<std::mutex> lock(timeline_mtx);
+                stream = timeline_stream;
+              }
+              Message server_message;
+              while (stream->Read(&server_message)) { //  reading messages from server
+                  if (!server_message.rejected().empty()) {
+                      // one of our posts, refused (rate limit or overload)
+                      std::cout << "Post not sent (" << server_message.rejected() << "): "
+                                << server_message.msg() << std::endl;
+                      continue;
+                  }
+                  last_seq = std::max<uint64_t>(last_seq, server_message.seq());
+                  last_hlc = std::max<uint64_t>(last_hlc, server_message.hlc());
+                  std::time_t timestamp = server_message.timestamp().seconds();
+                  displayPostMessage(server_message.username(), server_message.msg(), timestamp); // if msg exist post the msg in timeline
+                  if (trace && server_message.has_trace()) {
+                      trace_stats.add(server_message.trace(), now_us());
+                  }
+              }
+            }
+            reconnect();
         }
     });
     // Sending messages
+    char arena_block[ARENA_BLOCK_SIZE];
+    ArenaOptions arena_options;
+    arena_options.initial_block = arena_block;
+    arena_options.initial_block_size = sizeof(arena_block);
+    Arena arena(arena_options);
     std::string input;
     while (true) {  // This is for stdinput
         input = getPostMessage();  // capture the client input
-        Message message = MakeMessage(username, input);
-        stream->Write(message);  // write to the stream so that server process this msg
+        Message* message = MakeMessage(&arena, username, input);
+        if (trace) {
+            message->mutable_trace()->set_client_send_us(now_us());
+        }
+        while (true) {
+            std::unique_lock<std::mutex> lock(timeline_mtx);
+            std::shared_ptr<ClientReaderWriter<Message, Message>> stream = timeline_stream;
+            if (!stream) {
+                pending_posts.push_back(*message);  // stream is down, send after reconnecting
+                break;
+            }
+            // Write without timeline_mtx: a write blocked on a server that
+            // stopped reading is what reconnect() must be able to cancel
+            std::unique_lock<std::mutex> write_lock(write_mtx);
+            lock.unlock();
+            if (stream->Write(*message)) {  // write to the stream so that server process this msg
+                break;
+            }
+            write_lock.unlock();
+            lock.lock();
+            if (timeline_stream == stream) {
+                pending_posts.push_back(*message);  // the reconnect sends it on the new stream
+                break;
+            }
+            // replaced while we were writing; try the new stream
+        }
+        arena.Reset();
     }
-    stream->WritesDone();
     reader.join();  // Wait for the reader thread to finish
 
 }
 
+// Open a Timeline stream, resuming after last_seq if we have seen posts
+// before. Caller must hold timeline_mtx.
+bool Client::openTimeline() {
+    timeline_stream.reset();  // the stream must go before its context
+    timeline_context.reset(new ClientContext);
+    sns_client->prepareContext(timeline_context.get());
+    timeline_stream = sns_client->stub()->Timeline(timeline_context.get());   // bidirectional stream
+
+    Message initial_message;
+    initial_message.set_username(username);
+    if (last_seq > 0) {
+        initial_message.set_resume_after(last_seq);
+    } else {
+        initial_message.set_resume_after_hlc(last_hlc);
+    }
+    // When user enters timeline we just trigger the server to store the stream correspond to client
+    return timeline_stream->Write(initial_message);
+}
+
+// Called by the reader thread once the Timeline stream has failed. Retries
+// with jittered exponential backoff until the server (or, taking turns
+// with it, the failover server) takes our login again and a new stream is
+// open, then sends the posts typed in the meantime. A backup that has the
+// replicated timeline resumes it from last_seq like the primary would.
+void Client::reconnect() {
+    {
+      std::lock_guard<std::mutex> lock(timeline_mtx);
+      timeline_context->TryCancel();  // fails a write in progress too
+      std::lock_guard<std::mutex> write_lock(write_mtx);
+      grpc::Status status = timeline_stream->Finish();
+      timeline_stream.reset();  // posts typed from now on wait in pending_posts
+      if (status.error_code() == grpc::RESOURCE_EXHAUSTED) {
+          // too many streams open, or we fell too far behind
+          std::cout << "Timeline closed by the server: " << status.error_message() << std::endl;
+      }
+    }
+
+    std::mt19937 rng(std::random_device{}());
+    for (int attempt = 0; ; attempt++) {
+        int64_t cap = std::min<int64_t>(RECONNECT_MAX_MS, (int64_t)RECONNECT_BASE_MS << std::min(attempt, 16));
+        std::uniform_int_distribution<int64_t> delay(0, cap);
+        std::this_thread::sleep_for(std::chrono::milliseconds(delay(rng)));
+        std::string host = hostname;
+        std::string host_port = port;
+        if (!failover_address.empty() && attempt % 2 == 1) {
+            std::size_t colon = failover_address.rfind(':');
+            host = failover_address.substr(0, colon);
+            host_port = colon == std::string::npos ? port : failover_address.substr(colon + 1);
+        }
+        displayReConnectionMessage(host, host_port);
+
+        std::string server_address = host + ":" + host_port;
+        std::unique_ptr<SNSClient> client(new SNSClient(
+            grpc::CreateChannel(server_address, grpc::InsecureChannelCredentials()), username));
+
+        // A restarted server has forgotten us and needs a new Login; one
+        // that only dropped the stream still has us (ALREADY_EXISTS)
+        client->setTimeout(RECONNECT_LOGIN_TIMEOUT_S * 1000);
+        grpc::Status status = client->enableRouting();
+        if (status.ok()) {
+            status = client->login().get().status;
+        }
+        client->setTimeout(0);
+        if (!status.ok() && status.error_code() != grpc::ALREADY_EXISTS) {
+            continue;
+        }
+
+        std::lock_guard<std::mutex> lock(timeline_mtx);
+        sns_client = std::move(client);
+        if (server_address != timeline_address) {
+            last_seq = 0;  // that server's seqs aren't ours; resume by hlc
+            timeline_address = server_address;
+        }
+        if (!openTimeline()) {
+            timeline_context->TryCancel();
+            timeline_stream->Finish();
+            timeline_stream.reset();
+            continue;
+        }
+        std::lock_guard<std::mutex> write_lock(write_mtx);
+        for (const Message& post : pending_posts) {
+            timeline_stream->Write(post);
+        }
+        pending_posts.clear();
+        std::cout << "Reconnected to " << server_address << std::endl;
+        return;
+    }
+}
+
+
+
+// Result text of a batch FOLLOW/UNFOLLOW, using the same outcomes as the
+// interactive commands
+std::string batchResult(const grpc::Status& status) {
+    if (status.ok()) {
+        return "OK";
+    }
+    switch (status.error_code()) {
+    case grpc::ALREADY_EXISTS:
+        return "ALREADY_EXISTS";
+    case grpc::CANCELLED:  // the server's answer for an unknown user
+        return "INVALID_USERNAME";
+    default:
+        return "ERROR: " + status.error_message();
+    }
+}
+
+// One command of a batch script; result resolves to its printed outcome
+struct BatchCommand {
+  std::string line;
+  std::future<std::pair<bool, std::string>> result;
+};
+
+int Client::runBatch(std::istream& script, int max_in_flight) {
+    std::string server_address = hostname + ":" + port;
+    sns_client.reset(new SNSClient(grpc::CreateChannel(server_address, grpc::InsecureChannelCredentials()), username));
+    sns_client->enableRouting();
+    // a script usually runs as a user that already exists
+    grpc::Status status = sns_client->login().get().status;
+    if (!status.ok() && status.error_code() != grpc::ALREADY_EXISTS) {
+        std::cerr << "Login failed: " << status.error_message() << std::endl;
+        return 1;
+    }
+
+    // Commands in script order. The oldest is waited for, printed and
+    // dropped whenever max_in_flight are outstanding.
+    std::deque<BatchCommand> window;
+    int commands = 0;
+    int failures = 0;
+    auto printOldest = [&]() {
+        std::pair<bool, std::string> result = window.front().result.get();
+        std::cout << window.front().line << " -> " << result.second << "\n";
+        failures += result.first ? 0 : 1;
+        window.pop_front();
+    };
+    auto start = std::chrono::steady_clock::now();
+
+    std::string line;
+    while (std::getline(script, line)) {
+        line = trim(line);
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        commands++;
+        if ((int)window.size() == max_in_flight) {
+            printOldest();
+        }
+        std::istringstream iss(line);
+        std::string command, argument, extra;
+        iss >> command >> argument >> extra;
+        std::transform(command.begin(), command.end(), command.begin(), ::toupper);
+
+        BatchCommand cmd;
+        cmd.line = line;
+        if ((command == "FOLLOW" || command == "UNFOLLOW") && !argument.empty() && extra.empty()) {
+            std::shared_future<RpcResult<Reply>> reply =
+                command == "FOLLOW" ? sns_client->follow(argument) : sns_client->unfollow(argument);
+            cmd.result = std::async(std::launch::deferred, [reply]() {
+                const grpc::Status& status = reply.get().status;
+                return std::make_pair(status.ok(), batchResult(status));
+            });
+        } else if (command == "LIST" && argument.empty()) {
+            // one unpaged request, so it doesn't touch the interactive LIST cache
+            std::shared_future<RpcResult<ListReply>> reply = sns_client->list();
+            cmd.result = std::async(std::launch::deferred, [reply]() {
+                const RpcResult<ListReply>& list = reply.get();
+                if (!list.status.ok()) {
+                    return std::make_pair(false, "ERROR: " + list.status.error_message());
+                }
+                std::string text = "OK users=";
+                for (int i = 0; i < list.reply.all_users_size(); i++) {
+                    text += (i ? "," : "") + list.reply.all_users(i);
+                }
+                text += " followers=";
+                for (int i = 0; i < list.reply.followers_size(); i++) {
+                    text += (i ? "," : "") + list.reply.followers(i);
+                }
+                return std::make_pair(true, text);
+            });
+        } else {
+            std::promise<std::pair<bool, std::string>> invalid;
+            invalid.set_value(std::make_pair(false, std::string("INVALID")));
+            cmd.result = invalid.get_future();
+        }
+        window.push_back(std::move(cmd));
+    }
+    while (!window.empty()) {
+        printOldest();
+    }
+    std::cout.flush();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cerr << commands << " commands, " << failures << " failed, in " << seconds << "s" << std::endl;
+    return failures == 0 ? 0 : 1;
+}
+
 
 
 //////////////////////////////////////////////
@@ -345,9 +896,14 @@ int main(int argc, char** argv) {
   std::string hostname = "localhost";
   std::string username = "default";
   std::string port = "3010";
+  bool trace = false;
+  std::string batch_script;  // run commands from this file ("-" for stdin)
+  int in_flight = BATCH_IN_FLIGHT;
+  std::string failover;  // host:port of the backup server
+  std::string read_replica;  // host:port of a read replica
     
   int opt = 0;
-  while ((opt = getopt(argc, argv, "h:u:p:")) != -1){
+  while ((opt = getopt(argc, argv, "h:u:p:tb:j:f:R:")) != -1){
     switch(opt) {
     case 'h':
       hostname = optarg;break;
@@ -355,15 +911,37 @@ int main(int argc, char** argv) {
       username = optarg;break;
     case 'p':
       port = optarg;break;
+    case 't':
+      trace = true;break;
+    case 'b':
+      batch_script = optarg;break;
+    case 'j':
+      in_flight = std::max(1, atoi(optarg));break;
+    case 'f':
+      failover = optarg;break;
+    case 'R':
+      read_replica = optarg;break;
     default:
       std::cout << "Invalid Command Line Argument\n";
     }
   }
       
+  Client myc(hostname, username, port, trace, failover, read_replica);
+
+  if (!batch_script.empty()) {
+    if (batch_script == "-") {
+      return myc.runBatch(std::cin, in_flight);
+    }
+    std::ifstream script(batch_script);
+    if (!script) {
+      std::cerr << "Cannot open " << batch_script << std::endl;
+      return 1;
+    }
+    return myc.runBatch(script, in_flight);
+  }
+
   std::cout << "Logging Initialized. Client starting..."<<std::endl;
   
-  Client myc(hostname, username, port);
-  
   myc.run();
   
   return 0;
@@ -0,0 +1,306 @@
+/*
+ * tsload: load generator for tsd.
+ *
+ * Simulates many users from one process: logs them all in, builds a follow
+ * graph between them, opens a Timeline stream for every user and posts at a
+ * target rate from random users, while measuring how many posts are
+ * delivered to followers per second and how long delivery takes.
+ *
+ * Users are SNSClients from libsnsclient, whose calls and timeline
+ * subscriptions are asynchronous, so thousands of users don't need
+ * thousands of threads.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <grpc++/grpc++.h>
+
+#include "sns.grpc.pb.h"
+#include "sns_client.h"
+
+using grpc::Channel;
+using grpc::ClientContext;
+using grpc::Status;
+using csce662::FollowBatchReply;
+using csce662::FollowBatchRequest;
+using csce662::Message;
+using csce662::Reply;
+using csce662::Request;
+using csce662::SNSService;
+
+#define FOLLOW_BATCH_SIZE 1000
+// Logins in flight at once
+#define LOGIN_WINDOW 256
+
+// Wall-clock time in microseconds, as used by the trace fields of Message
+int64_t now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Delivery latencies (in us) and counters shared by every simulated user
+class LoadStats
+{
+public:
+  void delivered(const Message& post) {
+    int64_t now = now_us();
+    if (!post.rejected().empty()) {
+      rejected++;  // our own post, refused by the server
+      return;
+    }
+    deliveries++;
+    if (!post.has_trace() || post.trace().client_send_us() == 0) {
+      return; // history, not a post made by this run
+    }
+    std::lock_guard<std::mutex> lock(mtx);
+    end_to_end.push_back(now - post.trace().client_send_us());
+    if (post.trace().server_write_us() != 0) {
+      fanout.push_back(post.trace().server_write_us() - post.trace().fanout_enqueue_us());
+    }
+  }
+
+  std::atomic<uint64_t> posts{0};
+  std::atomic<uint64_t> deliveries{0};
+  std::atomic<uint64_t> stream_errors{0};
+  std::atomic<uint64_t> rejected{0};
+
+  void report(const std::string& name, std::vector<int64_t>& samples) {
+    if (samples.empty()) {
+      std::cout << name << ": no samples" << std::endl;
+      return;
+    }
+    std::sort(samples.begin(), samples.end());
+    auto pct = [&samples](double p) {
+      return samples[std::min(samples.size() - 1, static_cast<std::size_t>(p * samples.size()))] / 1000.0;
+    };
+    std::cout << std::fixed << std::setprecision(3)
+              << name << " (ms): n=" << samples.size() << " p50=" << pct(0.50) << " p99=" << pct(0.99)
+              << " p999=" << pct(0.999) << " max=" << samples.back() / 1000.0 << std::endl;
+    std::cout.unsetf(std::ios::floatfield);
+  }
+
+  void reportLatency() {
+    std::lock_guard<std::mutex> lock(mtx);
+    report("Delivery latency, poster enter -> follower read", end_to_end);
+    report("Server fan-out latency, fan-out start -> write", fanout);
+  }
+
+private:
+  std::mutex mtx;
+  std::vector<int64_t> end_to_end;
+  std::vector<int64_t> fanout;
+};
+
+// Followee lists for every user. With power_law, followees are drawn from a
+// Zipf distribution over a random ranking of users, so a few users are
+// followed by most and most by few; otherwise uniformly.
+std::vector<std::vector<int>> buildFollowGraph(int users, int follows, bool power_law, std::mt19937& rng) {
+    std::vector<int> rank(users);
+    for (int i = 0; i < users; i++) {
+        rank[i] = i;
+    }
+    std::shuffle(rank.begin(), rank.end(), rng);
+    std::vector<double> weights(users, 1.0);
+    if (power_law) {
+        for (int i = 0; i < users; i++) {
+            weights[i] = 1.0 / (i + 1);
+        }
+    }
+    std::discrete_distribution<int> pick(weights.begin(), weights.end());
+
+    std::vector<std::vector<int>> graph(users);
+    follows = std::min(follows, users - 1);
+    for (int u = 0; u < users; u++) {
+        std::vector<int>& followees = graph[u];
+        // give up on duplicates after a while so tiny graphs still finish
+        for (int tries = 0; (int)followees.size() < follows && tries < follows * 20; tries++) {
+            int v = rank[pick(rng)];
+            if (v != u && std::find(followees.begin(), followees.end(), v) == followees.end()) {
+                followees.push_back(v);
+            }
+        }
+    }
+    return graph;
+}
+
+void usage() {
+    std::cerr << "Usage: tsload [-h host] [-p port] [-n users] [-f follows per user]\n"
+              << "              [-g uniform|powerlaw] [-r posts/s] [-d seconds] [-x username prefix]\n";
+}
+
+int main(int argc, char** argv) {
+
+  std::string hostname = "localhost";
+  std::string port = "3010";
+  int users = 1000;
+  int follows = 10;
+  bool power_law = false;
+  double rate = 100;
+  int duration = 30;
+  std::string prefix = "load";
+
+  int opt = 0;
+  while ((opt = getopt(argc, argv, "h:p:n:f:g:r:d:x:")) != -1){
+    switch(opt) {
+    case 'h':
+      hostname = optarg;break;
+    case 'p':
+      port = optarg;break;
+    case 'n':
+      users = std::max(2, atoi(optarg));break;
+    case 'f':
+      follows = std::max(0, atoi(optarg));break;
+    case 'g':
+      power_law = std::string(optarg) == "powerlaw";break;
+    case 'r':
+      rate = std::max(0.1, atof(optarg));break;
+    case 'd':
+      duration = std::max(1, atoi(optarg));break;
+    case 'x':
+      prefix = optarg;break;
+    default:
+      usage();
+      return 1;
+    }
+  }
+
+  std::string server_address = hostname + ":" + port;
+  std::shared_ptr<Channel> channel = grpc::CreateChannel(server_address, grpc::InsecureChannelCredentials());
+  std::unique_ptr<SNSService::Stub> stub = SNSService::NewStub(channel);
+  std::mt19937 rng(std::random_device{}());
+  LoadStats stats;
+
+  // 1. Log every user in
+  auto phase_start = std::chrono::steady_clock::now();
+  std::vector<std::unique_ptr<SNSClient>> load_users;
+  std::deque<std::future<RpcResult<Reply>>> logins;
+  int login_failures = 0;
+  auto await_login = [&]() {
+      Status status = logins.front().get().status;
+      if (!status.ok() && status.error_code() != grpc::ALREADY_EXISTS) {
+          login_failures++;
+      }
+      logins.pop_front();
+  };
+  for (int u = 0; u < users; u++) {
+      load_users.emplace_back(new SNSClient(channel, prefix + std::to_string(u)));
+      if (logins.size() == LOGIN_WINDOW) {
+          await_login();
+      }
+      logins.push_back(load_users.back()->login());
+  }
+  while (!logins.empty()) {
+      await_login();
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - phase_start).count();
+  std::cout << "Logged in " << users << " users in " << seconds << "s (" << login_failures << " failures)" << std::endl;
+  if (login_failures == users) {
+      std::cerr << "Could not reach " << server_address << std::endl;
+      return 1;
+  }
+
+  // 2. Build the follow graph with FollowBatch
+  phase_start = std::chrono::steady_clock::now();
+  std::vector<std::vector<int>> graph = buildFollowGraph(users, follows, power_law, rng);
+  FollowBatchRequest batch;
+  int edges = 0;
+  int follow_failures = 0;
+  auto flush = [&]() {
+      if (batch.ops_size() == 0) {
+          return;
+      }
+      FollowBatchReply batch_reply;
+      ClientContext context;
+      Status status = stub->FollowBatch(&context, batch, &batch_reply);
+      for (const auto& result : batch_reply.results()) {
+          if (result.code() != grpc::OK && result.code() != grpc::ALREADY_EXISTS) {
+              follow_failures++;
+          }
+      }
+      if (!status.ok()) {
+          follow_failures += batch.ops_size();
+      }
+      batch.clear_ops();
+  };
+  for (int u = 0; u < users; u++) {
+      for (int v : graph[u]) {
+          auto* op = batch.add_ops();
+          op->set_follower(prefix + std::to_string(u));
+          op->set_followee(prefix + std::to_string(v));
+          edges++;
+          if (batch.ops_size() == FOLLOW_BATCH_SIZE) {
+              flush();
+          }
+      }
+  }
+  flush();
+  seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - phase_start).count();
+  std::cout << "Created " << edges << " follow edges (" << (power_law ? "power-law" : "uniform")
+            << ") in " << seconds << "s (" << follow_failures << " failures)" << std::endl;
+
+  // 3. Enter the timeline for every user
+  std::vector<std::unique_ptr<TimelineSubscription>> timelines;
+  for (int u = 0; u < users; u++) {
+      timelines.push_back(load_users[u]->subscribe(
+          [&stats](const Message& post) { stats.delivered(post); }, 0,
+          [&stats](const Status& status) {
+              if (!status.ok() && status.error_code() != grpc::CANCELLED) {
+                  stats.stream_errors++;
+              }
+          }));
+  }
+  std::this_thread::sleep_for(std::chrono::seconds(1));  // let history replay finish
+  uint64_t history = stats.deliveries.exchange(0);
+  std::cout << "Opened " << users << " timeline streams (" << history << " history posts)" << std::endl;
+
+  // 4. Post from random users at the target rate
+  std::uniform_int_distribution<int> pick_user(0, users - 1);
+  auto interval = std::chrono::duration<double>(1.0 / rate);
+  auto run_start = std::chrono::steady_clock::now();
+  auto next_post = run_start;
+  auto next_report = run_start + std::chrono::seconds(1);
+  uint64_t last_deliveries = 0;
+  while (std::chrono::steady_clock::now() - run_start < std::chrono::seconds(duration)) {
+      std::this_thread::sleep_until(next_post);
+      next_post += std::chrono::duration_cast<std::chrono::steady_clock::duration>(interval);
+
+      int poster = pick_user(rng);
+      Message post;
+      post.set_msg("load post " + std::to_string(stats.posts.load()));
+      post.mutable_timestamp()->set_seconds(time(NULL));
+      post.mutable_trace()->set_client_send_us(now_us());
+      timelines[poster]->post(post);
+      stats.posts++;
+
+      if (std::chrono::steady_clock::now() >= next_report) {
+          uint64_t deliveries = stats.deliveries.load();
+          std::cout << "posts=" << stats.posts << " deliveries/s=" << deliveries - last_deliveries << std::endl;
+          last_deliveries = deliveries;
+          next_report += std::chrono::seconds(1);
+      }
+  }
+  std::this_thread::sleep_for(std::chrono::seconds(2));  // drain deliveries in flight
+
+  seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - run_start).count();
+  std::cout << "Posted " << stats.posts << " posts in " << duration << "s, delivered " << stats.deliveries
+            << " (" << stats.deliveries / seconds << " deliveries/s), " << stats.stream_errors << " stream errors, "
+            << stats.rejected << " posts rejected" << std::endl;
+  stats.reportLatency();
+
+  for (auto& timeline : timelines) {
+      timeline->close();
+  }
+  return 0;
+}
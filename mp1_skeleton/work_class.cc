@@ -0,0 +1,101 @@
+#include "work_class.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+namespace work_class {
+
+namespace {
+
+const char* const names[CLASS_COUNT] = {
+  "Interactive", "Fanout", "History", "Background",
+};
+
+// The counters a slot touches are atomic, so a class with free slots (and
+// INTERACTIVE, which has no limit) never takes the mutex
+struct ClassState {
+  std::atomic<int> slots{0};
+  std::atomic<int> active{0};
+  std::atomic<uint64_t> entered{0};
+  // Guards the waiting side
+  std::mutex mtx;
+  std::condition_variable cv;
+  int waiting = 0;
+  uint64_t waited = 0;
+  uint64_t wait_ns = 0;
+};
+
+// Take a slot if the class is below its limit
+bool try_enter(ClassState& state) {
+  int active = state.active.load();
+  while (true) {
+    int slots = state.slots.load();
+    if (slots > 0 && active >= slots) {
+      return false;
+    }
+    if (state.active.compare_exchange_weak(active, active + 1)) {
+      return true;
+    }
+  }
+}
+
+ClassState classes[CLASS_COUNT];
+
+}
+
+const char* name(Class c) {
+  return names[c];
+}
+
+void setSlots(Class c, int slots) {
+  if (c == INTERACTIVE) {
+    return;
+  }
+  classes[c].slots = slots;
+  std::lock_guard<std::mutex> lock(classes[c].mtx);
+  classes[c].cv.notify_all();
+}
+
+Summary summarize(Class c) {
+  ClassState& state = classes[c];
+  Summary summary;
+  summary.slots = state.slots;
+  summary.active = state.active;
+  summary.entered = state.entered;
+  std::lock_guard<std::mutex> lock(state.mtx);
+  summary.waiting = state.waiting;
+  summary.waited = state.waited;
+  summary.wait_ns = state.wait_ns;
+  return summary;
+}
+
+Slot::Slot(Class c) : cls(c) {
+  ClassState& state = classes[c];
+  state.entered++;
+  if (try_enter(state)) {
+    return;
+  }
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  std::unique_lock<std::mutex> lock(state.mtx);
+  state.waited++;
+  state.waiting++;
+  state.cv.wait(lock, [&state]() { return try_enter(state); });
+  state.waiting--;
+  state.wait_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - start).count();
+}
+
+// A waiter checks under the mutex, so taking it before the notify means
+// the release can't slip in between its check and its wait
+Slot::~Slot() {
+  ClassState& state = classes[cls];
+  state.active--;
+  if (state.slots > 0) {
+    { std::lock_guard<std::mutex> lock(state.mtx); }
+    state.cv.notify_one();
+  }
+}
+
+}
@@ -0,0 +1,64 @@
+#ifndef WORK_CLASS_H
+#define WORK_CLASS_H
+
+#include <cstdint>
+
+/*
+ * Priority classes for the server's work, so bulk work can't take the
+ * server from interactive calls.
+ *
+ * Every gRPC call runs on a thread of the server's shared pool. Interactive
+ * unary calls (Login, List, Follow, ...) never wait. Each bulk class has a
+ * fixed number of slots, and a thread must hold one of its class's slots
+ * while it does that work. A reconnect storm replaying history, or a burst
+ * of large fan-outs, then keeps at most that many threads on the disk and
+ * CPU at once, and the others wait off-CPU. The slot counts act as the
+ * weights between the classes.
+ */
+namespace work_class {
+
+enum Class {
+  INTERACTIVE,  // unary client calls; never waits
+  FANOUT,       // delivering a new post to followers
+  HISTORY,      // Timeline history and replay on (re)connect
+  BACKGROUND,   // housekeeping, such as the stream reaper's sweeps
+  CLASS_COUNT
+};
+
+const char* name(Class c);
+
+// At most slots threads do work of class c at once (0 = no limit). Call
+// before serving; INTERACTIVE is never limited.
+void setSlots(Class c, int slots);
+
+struct Summary {
+  int slots = 0;
+  // holding a slot, and waiting for one, now
+  int active = 0;
+  int waiting = 0;
+  // slots taken, how many of those had to wait, and for how long in total
+  uint64_t entered = 0;
+  uint64_t waited = 0;
+  uint64_t wait_ns = 0;
+};
+
+Summary summarize(Class c);
+
+// Holds a slot of its class from construction to destruction, waiting for
+// one if the class is at its limit
+class Slot
+{
+public:
+  explicit Slot(Class c);
+  ~Slot();
+
+  Slot(const Slot&) = delete;
+  Slot& operator=(const Slot&) = delete;
+
+private:
+  Class cls;
+};
+
+}
+
+#endif